@@ -0,0 +1,177 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+
+#include "nasmon.h"
+
+/*
+ * Calibration: hold all fans at each duty of the schedule for one step,
+ * record every controller input, and fit a first order model
+ *
+ *   tau * dT/dt = T_ss(pwm) - T,   T_ss(pwm) = T_0 + gain * pwm
+ *
+ * from each step response: the gain from the settled temperatures, the
+ * time constant from the 63.2% rise time. The PI gains follow from the
+ * lambda tuning rule with the closed loop as fast as the open one:
+ * kp = 1 / |gain|, ki = kp / tau.
+ */
+
+static const int calib_schedule[] = {255, 96, 176, 255};
+#define CALIB_STEPS ((int)(sizeof(calib_schedule) / sizeof(calib_schedule[0])))
+
+static const int calib_tick = 5;
+static const double calib_min_delta = 0.5;  /* C, a smaller response is noise */
+static const double calib_kp_max = 64;
+
+struct nas_calib_input {
+	double *samples;
+	double t0;
+	double tau_sum;
+	double gain_sum;
+	int fits;
+	double low;
+	double high;
+};
+
+static void nas_calib_abort(const char *reason) {
+	nas_fan_force(255);
+	syslog(LOG_ERR, "calibration aborted: %s", reason);
+	printf("calibration aborted: %s\n", reason);
+	exit(EXIT_FAILURE);
+}
+
+static void nas_calib_fit(struct nas_calib_input *in, const int ticks, const int dp) {
+	int tail = ticks / 10 > 0 ? ticks / 10 : 1;
+	double t_end = 0;
+
+	for (int k = ticks - tail; k < ticks; k++)
+		t_end += in->samples[k];
+	t_end /= tail;
+
+	double delta = t_end - in->t0;
+	if (fabs(delta) >= calib_min_delta) {
+		int k = 0;
+		while ((k < ticks - 1) && ((in->samples[k] - in->t0) / delta < 0.632))
+			k++;
+
+		in->tau_sum += (k + 1) * calib_tick;
+		in->gain_sum += delta / dp;
+		in->fits++;
+	}
+	in->t0 = t_end;
+}
+
+static void nas_calib_save(const char *file, const struct nas_calib_input *inputs, const int count,
+			   const int step) {
+	char tmp_file[strlen(file) + 5];
+	char date[32];
+	time_t now = time(NULL);
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&now));
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", file);
+	FILE *fp = fopen(tmp_file, "w");
+	if (fp == NULL) {
+		syslog(LOG_ERR, "can not write fan tuning %s: %d", tmp_file, errno);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(fp, "# nasmon fan tuning, calibrated %s, %ds per step at PWM", date, step);
+	for (int s = 0; s < CALIB_STEPS; s++)
+		fprintf(fp, " %d", calib_schedule[s]);
+	fprintf(fp, "\n");
+
+	for (int i = 0; i < count; i++) {
+		const struct nas_calib_input *in = inputs + i;
+		const char *name = nas_fan_input_name(i);
+
+		fprintf(fp, "\n[fan_control]\ninput = %s\n", name);
+
+		double gain = in->fits > 0 ? in->gain_sum / in->fits : 0;
+		if (gain >= 0) {
+			fprintf(fp, "# no response to the fans, not tuned\n");
+			printf("%-16s no response to the fans\n", name);
+			continue;
+		}
+
+		double tau = in->tau_sum / in->fits;
+		double kp = -1 / gain;
+		if (kp > calib_kp_max)
+			kp = calib_kp_max;
+
+		fprintf(fp, "# first order model: tau %.0fs, gain %.4fC per PWM\n", tau, gain);
+		fprintf(fp, "target = %.1f\nkp = %.2f\nki = %.4f\n", (in->low + in->high) / 2, kp, kp / tau);
+		printf("%-16s tau %4.0fs, gain %.4fC/PWM -> kp %.2f, ki %.4f\n", name, tau, gain, kp, kp / tau);
+	}
+
+	if ((fclose(fp) != 0) || (rename(tmp_file, file) != 0)) {
+		syslog(LOG_ERR, "failed to save fan tuning %s: %d", file, errno);
+		unlink(tmp_file);
+		exit(EXIT_FAILURE);
+	}
+	syslog(LOG_INFO, "fan tuning saved to %s", file);
+}
+
+void nas_calibrate(const char *file, const int step) {
+	int count = nas_fan_inputs();
+	int ticks = step / calib_tick;
+	char reason[64];
+
+	if (ticks < 12)
+		ticks = 12;
+
+	struct nas_calib_input *inputs = calloc((size_t)count, sizeof(*inputs));
+	double *samples = calloc((size_t)count * ticks, sizeof(*samples));
+	if ((inputs == NULL) || (samples == NULL)) {
+		syslog(LOG_ERR, "allocate memory for calibration failed: %d", errno);
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < count; i++) {
+		inputs[i].samples = samples + i * ticks;
+		nas_fan_input_range(i, &inputs[i].low, &inputs[i].high);
+	}
+
+	printf("calibrate %d input(s), %d steps of %ds\n", count, CALIB_STEPS, ticks * calib_tick);
+	for (int s = 0; s < CALIB_STEPS; s++) {
+		nas_fan_force(calib_schedule[s]);
+		printf("step %d: pwm %d\n", s + 1, calib_schedule[s]);
+
+		for (int k = 0; k < ticks; k++) {
+			sleep(calib_tick);
+
+			/* board sensors are otherwise read once a minute or less, too coarse for a time constant */
+			time_t now = time(NULL);
+			if ((nas_sensor_update_all() != 0) || (nas_disk_update(now) != 0))
+				nas_calib_abort("sensor out of limits");
+
+			for (int i = 0; i < count; i++) {
+				double t = nas_fan_input_temp(i);
+				inputs[i].samples[k] = t;
+				if (t >= inputs[i].high) {
+					snprintf(reason, sizeof(reason), "%s reached %.1fC", nas_fan_input_name(i), t);
+					nas_calib_abort(reason);
+				}
+			}
+		}
+
+		/* the first step only settles the box at full speed */
+		for (int i = 0; i < count; i++) {
+			if (s == 0)
+				inputs[i].t0 = inputs[i].samples[ticks - 1];
+			else
+				nas_calib_fit(inputs + i, ticks, calib_schedule[s] - calib_schedule[s - 1]);
+		}
+	}
+
+	nas_calib_save(file, inputs, count, ticks * calib_tick);
+	free(samples);
+	free(inputs);
+}
@@ -0,0 +1,226 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "nasmon.h"
+
+/*
+ * nasmon config file, INI style:
+ *
+ *   # comment
+ *   [section]
+ *   key = value
+ *
+ * A section name may repeat, e.g. one [sensor] section per sensor. Keys
+ * before the first section belong to the unnamed section 0.
+ */
+
+struct nas_conf_entry {
+	char *key;
+	char *value;
+};
+
+struct nas_conf_section {
+	char *name;
+	int count;
+	int size;
+	struct nas_conf_entry *entries;
+};
+
+static int nas_conf_count = 0;
+static int nas_conf_size = 0;
+static struct nas_conf_section *nas_conf = NULL;
+
+void nas_conf_free(void) {
+	for (int i = 0; i < nas_conf_count; i++) {
+		for (int j = 0; j < nas_conf[i].count; j++) {
+			free(nas_conf[i].entries[j].key);
+			free(nas_conf[i].entries[j].value);
+		}
+		free(nas_conf[i].entries);
+		free(nas_conf[i].name);
+	}
+	free(nas_conf);
+	nas_conf = NULL;
+	nas_conf_count = 0;
+}
+
+static char *nas_conf_trim(char *s) {
+	while ((*s == ' ') || (*s == '\t'))
+		s++;
+
+	char *end = s + strlen(s);
+	while ((end > s) && ((end[-1] == ' ') || (end[-1] == '\t') || (end[-1] == '\n') || (end[-1] == '\r')))
+		end--;
+	*end = '\0';
+
+	return s;
+}
+
+static int nas_conf_add_section(const char *name) {
+	if (nas_conf_count >= nas_conf_size) {
+		nas_conf_size = nas_conf_size ? nas_conf_size * 2 : 8;
+		struct nas_conf_section *p = realloc(nas_conf, sizeof(*p) * nas_conf_size);
+		if (p == NULL)
+			return -1;
+		nas_conf = p;
+	}
+
+	struct nas_conf_section *sec = nas_conf + nas_conf_count;
+	memset(sec, 0, sizeof(*sec));
+	if ((sec->name = strdup(name)) == NULL)
+		return -1;
+
+	return nas_conf_count++;
+}
+
+static int nas_conf_add_entry(struct nas_conf_section *sec, const char *key, const char *value) {
+	if (sec->count >= sec->size) {
+		sec->size = sec->size ? sec->size * 2 : 8;
+		struct nas_conf_entry *p = realloc(sec->entries, sizeof(*p) * sec->size);
+		if (p == NULL)
+			return -1;
+		sec->entries = p;
+	}
+
+	struct nas_conf_entry *entry = sec->entries + sec->count;
+	if (((entry->key = strdup(key)) == NULL) || ((entry->value = strdup(value)) == NULL))
+		return -1;
+
+	sec->count++;
+	return 0;
+}
+
+static void nas_conf_parse(FILE *fp, const char *file) {
+	char line[512];
+	int lineno = 0;
+
+	int sec = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+
+		char *p = nas_conf_trim(line);
+		if ((*p == '\0') || (*p == '#') || (*p == ';'))
+			continue;
+
+		if (*p == '[') {
+			char *end = strchr(p, ']');
+			if (end == NULL) {
+				syslog(LOG_ERR, "%s:%d: unterminated section", file, lineno);
+				exit(EXIT_FAILURE);
+			}
+			*end = '\0';
+			if ((sec = nas_conf_add_section(nas_conf_trim(p + 1))) < 0)
+				break;
+			continue;
+		}
+
+		char *eq = strchr(p, '=');
+		if (eq == NULL) {
+			syslog(LOG_ERR, "%s:%d: expect key = value", file, lineno);
+			exit(EXIT_FAILURE);
+		}
+		*eq = '\0';
+
+		char *value = eq + 1;
+		char *comment = strstr(value, " #");
+		if (comment != NULL)
+			*comment = '\0';
+
+		if (nas_conf_add_entry(nas_conf + sec, nas_conf_trim(p), nas_conf_trim(value)) < 0) {
+			sec = -1;
+			break;
+		}
+	}
+
+	if (sec < 0) {
+		syslog(LOG_ERR, "failed to allocate memory for config");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void nas_conf_init(void) {
+	if (nas_conf != NULL)
+		return;
+
+	if (nas_conf_add_section("") < 0) {
+		syslog(LOG_ERR, "failed to allocate memory for config");
+		exit(EXIT_FAILURE);
+	}
+	atexit(nas_conf_free);
+}
+
+/*
+ * Files may be loaded one after another, their sections are appended;
+ * keys before the first section of any file go to the unnamed section 0.
+ */
+void nas_conf_load(const char *file) {
+	nas_conf_init();
+
+	if (file == NULL)
+		return;
+
+	FILE *fp = fopen(file, "r");
+	if (fp == NULL) {
+		syslog(LOG_ERR, "Open config file %s failed: %d", file, errno);
+		exit(EXIT_FAILURE);
+	}
+
+	int first = nas_conf_count;
+	nas_conf_parse(fp, file);
+	fclose(fp);
+
+	syslog(LOG_INFO, "load %d section(s) from config %s", nas_conf_count - first, file);
+}
+
+/* same as nas_conf_load, a missing file is fine */
+void nas_conf_load_optional(const char *file) {
+	nas_conf_init();
+
+	if ((file == NULL) || ((access(file, F_OK) != 0) && (errno == ENOENT))) {
+		syslog(LOG_INFO, "no config %s", file != NULL ? file : "");
+		return;
+	}
+	nas_conf_load(file);
+}
+
+/* index of the next section with given name after prev, -1 if none */
+int nas_conf_next(const char *name, const int prev) {
+	for (int i = prev + 1; i < nas_conf_count; i++) {
+		if (strcmp(nas_conf[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *nas_conf_get(const int sec, const char *key) {
+	if ((sec < 0) || (sec >= nas_conf_count))
+		return NULL;
+
+	/* the last one wins */
+	for (int i = nas_conf[sec].count - 1; i >= 0; i--) {
+		if (strcmp(nas_conf[sec].entries[i].key, key) == 0)
+			return nas_conf[sec].entries[i].value;
+	}
+	return NULL;
+}
+
+double nas_conf_get_double(const int sec, const char *key, const double def) {
+	const char *value = nas_conf_get(sec, key);
+	return value != NULL ? strtod(value, NULL) : def;
+}
+
+int nas_conf_get_bool(const int sec, const char *key, const int def) {
+	const char *value = nas_conf_get(sec, key);
+	if (value == NULL)
+		return def;
+
+	return (strcmp(value, "yes") == 0) || (strcmp(value, "true") == 0) || (strcmp(value, "1") == 0);
+}
@@ -8,12 +8,33 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "nasmon.h"
 
 static int cpu_core_count = 1;
 static int64_t cpu_freq[NAS_CPU_FREQ_COUNT] = {0};
 static int spec = NAS_CPU_FREQ_MIN;
+/* the limit chosen on the LCD, and the ones forced by the protections */
+static int selected = NAS_CPU_FREQ_MAX;
+static int caps[NAS_CPU_CAP_REASONS] = {NAS_CPU_FREQ_MAX, NAS_CPU_FREQ_MAX, NAS_CPU_FREQ_MAX};
+static const char *const cap_names[NAS_CPU_CAP_REASONS] = {"fan", "thermal", "ladder"};
+static int64_t applied = 0;
+
+/*
+ * Cap ladder: once the fans are at full speed and the CPU is still near
+ * its halt temperature, step scaling_max_freq down one level at a time;
+ * step back up when it has cooled well below, each step held a while.
+ */
+static const double ladder_down_margin = 2;     /* C below halt */
+static const double ladder_up_margin = 8;
+static const int ladder_fan_headroom = 8;       /* PWM left counts as exhausted */
+static const int ladder_down_ticks = 3;
+static const int ladder_up_ticks = 12;
+static int ladder_count = 0;
+static double throttled_time = 0;
+static struct timespec ladder_ts;
+static const char *const spec_names[NAS_CPU_FREQ_COUNT] = {"min", "low", "high", "max"};
 
 void cpu_freq_init(void) {
 	char buf[16];
@@ -44,9 +65,9 @@ void cpu_freq_init(void) {
 		cpu_freq[NAS_CPU_FREQ_HIGH] = cpu_freq[NAS_CPU_FREQ_MIN] * 2;
 	} else {
 		cpu_freq[NAS_CPU_FREQ_LOW] = cpu_freq[NAS_CPU_FREQ_MIN] +
-					     (cpu_freq[NAS_CPU_FREQ_MAX] - cpu_freq[NAS_CPU_FREQ_MIN]) * 2 / 3;
+					     (cpu_freq[NAS_CPU_FREQ_MAX] - cpu_freq[NAS_CPU_FREQ_MIN]) / 3;
 		cpu_freq[NAS_CPU_FREQ_HIGH] = cpu_freq[NAS_CPU_FREQ_MIN] +
-					      (cpu_freq[NAS_CPU_FREQ_MAX] - cpu_freq[NAS_CPU_FREQ_MIN]) / 3;
+					      (cpu_freq[NAS_CPU_FREQ_MAX] - cpu_freq[NAS_CPU_FREQ_MIN]) * 2 / 3;
 	}
 
 	syslog(LOG_INFO, "Total %d CPUs, Freq %d/%d/%d/%d MHz",
@@ -57,6 +78,41 @@ void cpu_freq_init(void) {
 	       (int)(cpu_freq[NAS_CPU_FREQ_MAX] / 1000));
 }
 
+/* the lowest of the fan, thermal and ladder caps */
+static int cpu_freq_lowest_cap(void) {
+	int cap = NAS_CPU_FREQ_MAX;
+	for (int i = 0; i < NAS_CPU_CAP_REASONS; i++) {
+		if (cpu_freq[caps[i]] < cpu_freq[cap])
+			cap = caps[i];
+	}
+	return cap;
+}
+
+/* write the lowest of the selected and the capped frequencies, if it changes */
+static int cpu_freq_apply(void) {
+	int err = 0;
+	int64_t freq_in_khz = cpu_freq[selected];
+	char freq_str[16];
+	char name[80];
+
+	int64_t capped = cpu_freq[cpu_freq_lowest_cap()];
+	if (capped < freq_in_khz)
+		freq_in_khz = capped;
+
+	if ((freq_in_khz == 0) || (freq_in_khz == applied))
+		return 0;
+
+	syslog(LOG_INFO, "Max CPU Freq set to %dMHz", (int)(freq_in_khz / 1000));
+	sprintf(freq_str, "%ld", freq_in_khz);
+	for (int i = 0; i < cpu_core_count; i++) {
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_max_freq", i);
+		if (nas_write_file(name, freq_str, strlen(freq_str)) < 0)
+			err = -1;
+	}
+	applied = freq_in_khz;
+	return err;
+}
+
 int cpu_freq_select(const int page_switch, const int off) {
 	int err = 0;
 	int64_t freq_in_khz;
@@ -70,15 +126,54 @@ int cpu_freq_select(const int page_switch, const int off) {
 
 	if ((page_switch == 0) && (off == 0)) {
 		/* OK button pressed */
-		char freq_str[16];
-		char name[80];
-		syslog(LOG_INFO, "Max CPU Freq set to %dMHz", freq_in_mhz);
-		sprintf(freq_str, "%ld", freq_in_khz);
-		for (int i = 0; i < cpu_core_count; i++) {
-			sprintf(name, "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_max_freq", i);
-			if (nas_write_file(name, freq_str, strlen(freq_str)) < 0)
-				err = -1;
-		}
+		selected = spec;
+		err = cpu_freq_apply();
 	}
 	return err;
 }
+
+/* called on every tick with the smallest CPU distance to halt and the fan duty left */
+void cpu_freq_ladder(const double margin, const int headroom) {
+	int level = caps[NAS_CPU_CAP_LADDER];
+	double dt = ladder_ts.tv_sec != 0 ? nas_elapsed_ms(&ladder_ts) / 1000.0 : 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ladder_ts);
+	/* a cap below the front panel choice, the choice itself is no throttling */
+	if (cpu_freq[cpu_freq_lowest_cap()] < cpu_freq[selected])
+		throttled_time += dt;
+
+	if ((headroom <= ladder_fan_headroom) && (margin <= ladder_down_margin) && (level > NAS_CPU_FREQ_MIN)) {
+		ladder_count = ladder_count > 0 ? ladder_count + 1 : 1;
+		if (ladder_count >= ladder_down_ticks) {
+			ladder_count = 0;
+			cpu_freq_cap(NAS_CPU_CAP_LADDER, level - 1);
+		}
+	} else if ((margin >= ladder_up_margin) && (level < NAS_CPU_FREQ_MAX)) {
+		ladder_count = ladder_count < 0 ? ladder_count - 1 : -1;
+		if (-ladder_count >= ladder_up_ticks) {
+			ladder_count = 0;
+			cpu_freq_cap(NAS_CPU_CAP_LADDER, level + 1);
+		}
+	} else
+		ladder_count = 0;
+}
+
+int cpu_freq_to_json(char *buf, const size_t len) {
+	int cap = cpu_freq_lowest_cap();
+
+	return snprintf(buf, len, "\"MaxFreq\":%d,\"Cap\":\"%s\",\"Ladder\":\"%s\",\"ThrottledSeconds\":%.0f",
+			(int)((applied != 0 ? applied : cpu_freq[NAS_CPU_FREQ_MAX]) / 1000), spec_names[cap],
+			spec_names[caps[NAS_CPU_CAP_LADDER]], throttled_time);
+}
+
+void cpu_freq_cap(const nas_cpu_cap_reason reason, const nas_cpu_freq_spec limit) {
+	if (limit == caps[reason])
+		return;
+
+	if (limit != NAS_CPU_FREQ_MAX)
+		syslog(LOG_WARNING, "%s: cap CPU Freq to %dMHz", cap_names[reason], (int)(cpu_freq[limit] / 1000));
+	else
+		syslog(LOG_NOTICE, "%s: CPU Freq cap removed", cap_names[reason]);
+	caps[reason] = limit;
+	cpu_freq_apply();
+}
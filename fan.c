@@ -9,96 +9,202 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
 #include "nasmon.h"
 
+/* an output change below the threshold is written after pwm_skip_max ticks */
 static const int pwm_update_threshold = 4;
 static const int pwm_skip_max = 36;
 
-static char *pwm_enable_dev = NULL;
-static char default_pwm_enable = -1;
-static unsigned char default_pwm_output = 0;
-static int pwm_fd = -1;
-static int pwm_last = 0;
+#define NAS_FAN_CURVE_POINTS 8
+#define NAS_FAN_MAX 16
 
-static void nas_fan_set_enable(int enable, int save) {
+/*
+ * Tachometer feedback: the RPM expected at each PWM level is learned
+ * per bucket while the fan behaves; a reading far below it for a few
+ * settled ticks marks the fan degraded, no rotation at all stalled.
+ */
+#define NAS_FAN_TACH_BUCKETS 16
+static const int tach_settle_ticks = 2;     /* RPM lags a PWM change */
+static const int tach_learn_min = 3;        /* samples before a bucket is trusted */
+static const double tach_learn_alpha = 0.1;
+static const double tach_drift_ratio = 0.25;
+static const int tach_drift_ticks = 6;
+static const int tach_stall_ticks = 2;
+static const int tach_recover_ticks = 6;    /* OK readings in a row back to normal */
+static const int tach_stall_pwm = 128;      /* some fans stop below it, alarm only if learned spinning */
+static const int tach_boost = 64;
+
+enum {
+	NAS_FAN_OK,
+	NAS_FAN_DEGRADED,
+	NAS_FAN_STALLED
+};
+
+static const char *const nas_fan_state_names[] = {"ok", "degraded", "stalled"};
+
+/* one PWM output, restored to its initial mode and duty on exit */
+struct nas_fan {
+	char name[16];
+	char *enable_dev;
+	char default_enable;
+	unsigned char default_output;
+	int fd;
+	int last;
+	int skip_count;
+	int tach;           /* fan sensor id, -1 without tachometer */
+	int state;
+	int settle;
+	int bad_count;
+	int ok_count;
+	double rpm;
+	double curve[NAS_FAN_TACH_BUCKETS];
+	unsigned short samples[NAS_FAN_TACH_BUCKETS];
+};
+
+enum {
+	NAS_FAN_INPUT_SENSOR,
+	NAS_FAN_INPUT_HDD,
+	NAS_FAN_INPUT_SSD,
+	NAS_FAN_INPUT_DISK
+};
+
+struct nas_fan_point {
+	double temp;
+	double pwm;
+};
+
+/*
+ * One controller per thermal input: the fan curve is the feed-forward
+ * part, a PID loop around the optional target temperature corrects it.
+ */
+struct nas_fan_ctrl {
+	char name[32];
+	int input;
+	int sensor;
+	unsigned int zones; /* bit mask of the fans it drives */
+	int points;
+	struct nas_fan_point curve[NAS_FAN_CURVE_POINTS];
+	double target;
+	double kp;
+	double ki;
+	double kd;
+	double integral;
+	double slope;       /* filtered dT/dt, C/s */
+	double last_temp;
+	double output;
+};
+
+static int nas_fan_count = 0;
+static struct nas_fan nas_fans[NAS_FAN_MAX];
+
+static int nas_fan_ctrl_count = 0;
+static struct nas_fan_ctrl *nas_fan_ctrls = NULL;
+static struct timespec nas_fan_ts;
+static int nas_fan_floor = 0;       /* minimum duty of every fan, set by the thermal guard */
+
+static void nas_fan_set_enable(struct nas_fan *fan, int enable, int save) {
 	char pwm_enable[3];
 
-	int pwm_enable_fd = open(pwm_enable_dev, O_RDWR);
+	int pwm_enable_fd = open(fan->enable_dev, O_RDWR);
 	if (pwm_enable_fd < 0) {
-		syslog(LOG_ERR, "open pwm_enable device failed: %d", errno);
+		syslog(LOG_ERR, "open %s failed: %d", fan->enable_dev, errno);
 		exit(EXIT_FAILURE);
 	}
 
 	if (save != 0) {
 		if (read(pwm_enable_fd, pwm_enable, 1) <= 0) {
-			syslog(LOG_ERR, "read pwm_enable device failed: %d", errno);
+			syslog(LOG_ERR, "read %s failed: %d", fan->enable_dev, errno);
 			exit(EXIT_FAILURE);
 		}
-		default_pwm_enable = (char)(pwm_enable[0] - '0');
+		fan->default_enable = (char)(pwm_enable[0] - '0');
 	}
 
-	if (default_pwm_enable != (char)enable) {
+	if (fan->default_enable != (char)enable) {
 		pwm_enable[0] = (char)('0' + enable);
 		pwm_enable[1] = '\n';
 		pwm_enable[2] = '\0';
 
 		if (write(pwm_enable_fd, pwm_enable, 3) != 3)
-			syslog(LOG_ERR, "write pwm_enable device failed: %d", errno);
+			syslog(LOG_ERR, "write %s failed: %d", fan->enable_dev, errno);
 	}
 
 	nas_safe_close(pwm_enable_fd);
 }
 
-static void nas_fan_output(int value) {
+static void nas_fan_output(const struct nas_fan *fan, int value) {
 	char pwm_buf[6];
 	sprintf(pwm_buf, "%d\n", value);
 
-	if (write(pwm_fd, pwm_buf, strlen(pwm_buf)) < 0)
-		syslog(LOG_ERR, "pwm output file write failed: %d", errno);
+	if (write(fan->fd, pwm_buf, strlen(pwm_buf)) < 0)
+		syslog(LOG_ERR, "fan %s: pwm output file write failed: %d", fan->name, errno);
 }
 
 void nas_fan_free(void) {
-	if (pwm_fd >= 0) {
-		syslog(LOG_INFO, "restore initial pwm output: %d", default_pwm_output);
-		if (default_pwm_output != (unsigned char)pwm_last)
-			nas_fan_output(default_pwm_output);
+	free(nas_fan_ctrls);
 
-		nas_safe_close(pwm_fd);
-		pwm_fd = -1;
-	}
-	if (pwm_enable_dev != NULL) {
-		if ((default_pwm_enable >= 0) && (default_pwm_enable != 1))
-			nas_fan_set_enable(default_pwm_enable, 0);
+	for (int i = 0; i < nas_fan_count; i++) {
+		struct nas_fan *fan = nas_fans + i;
+
+		if (fan->fd >= 0) {
+			syslog(LOG_INFO, "fan %s: restore initial pwm output: %d", fan->name, fan->default_output);
+			if (fan->default_output != (unsigned char)fan->last)
+				nas_fan_output(fan, fan->default_output);
 
-		free(pwm_enable_dev);
+			nas_safe_close(fan->fd);
+			fan->fd = -1;
+		}
+		if (fan->enable_dev != NULL) {
+			if ((fan->default_enable >= 0) && (fan->default_enable != 1))
+				nas_fan_set_enable(fan, fan->default_enable, 0);
+
+			free(fan->enable_dev);
+			fan->enable_dev = NULL;
+		}
 	}
+	nas_fan_count = 0;
 }
 
-void nas_fan_init(const char *dev) {
+static void nas_fan_open(const char *name, const char *dev) {
 	size_t fan_dev_len = strlen(dev);
 	char pwm_buf[4];
 
-	pwm_enable_dev = malloc(fan_dev_len + 8);
-	if (pwm_enable_dev == NULL) {
+	if (nas_fan_count >= NAS_FAN_MAX) {
+		syslog(LOG_ERR, "too many fans, max %d", NAS_FAN_MAX);
+		exit(EXIT_FAILURE);
+	}
+
+	struct nas_fan *fan = nas_fans + nas_fan_count;
+	memset(fan, 0, sizeof(*fan));
+	fan->default_enable = -1;
+	fan->fd = -1;
+	fan->tach = -2;
+	fan->settle = tach_settle_ticks;
+	snprintf(fan->name, sizeof(fan->name), "%s", name);
+
+	fan->enable_dev = malloc(fan_dev_len + 8);
+	if (fan->enable_dev == NULL) {
 		syslog(LOG_ERR, "allocate memory for PWM_enable device failed: %d", errno);
 		exit(EXIT_FAILURE);
 	}
 
-	memcpy(pwm_enable_dev, dev, fan_dev_len);
-	strncpy(pwm_enable_dev + fan_dev_len, "_enable", 8);
+	memcpy(fan->enable_dev, dev, fan_dev_len);
+	strncpy(fan->enable_dev + fan_dev_len, "_enable", 8);
 
-	syslog(LOG_INFO, "Fan device: %s, %s", pwm_enable_dev, dev);
+	syslog(LOG_INFO, "Fan %s device: %s, %s", fan->name, fan->enable_dev, dev);
 
-	pwm_fd = open(dev, O_RDWR);
-	if (pwm_fd < 0) {
-		syslog(LOG_ERR, "open Fan PWM device failed: %d", errno);
+	fan->fd = open(dev, O_RDWR);
+	if (fan->fd < 0) {
+		syslog(LOG_ERR, "open Fan PWM device %s failed: %d", dev, errno);
+		free(fan->enable_dev);
 		exit(EXIT_FAILURE);
 	}
-	atexit(nas_fan_free);
+	/* from here on nas_fan_free restores it */
+	nas_fan_count++;
 
 	memset(pwm_buf, 0, sizeof(pwm_buf));
-	if (read(pwm_fd, pwm_buf, 3) < 0)
+	if (read(fan->fd, pwm_buf, 3) < 0)
 		syslog(LOG_ERR, "pwm file read failed: %d", errno);
 
 	for (int i = 0; i < sizeof(pwm_buf); i++) {
@@ -107,22 +213,557 @@ void nas_fan_init(const char *dev) {
 			break;
 		}
 	}
-	pwm_last = (int)strtol(pwm_buf, NULL, 10);
-	default_pwm_output = (unsigned char)pwm_last;
-	syslog(LOG_INFO, "initial pwm output: %d", pwm_last);
+	fan->last = (int)strtol(pwm_buf, NULL, 10);
+	fan->default_output = (unsigned char)fan->last;
+	syslog(LOG_INFO, "fan %s: initial pwm output: %d", fan->name, fan->last);
 
-	nas_fan_set_enable(1, 1);
+	nas_fan_set_enable(fan, 1, 1);
 }
 
-void nas_fan_update(const int sensor, const int disk) {
-	static int pwm_skip_count = 0;
-	int pwm = sensor > disk ? sensor : disk;
+static int nas_fan_tach_used(const int id) {
+	for (int i = 0; i < nas_fan_count; i++) {
+		if (nas_fans[i].tach == id)
+			return 1;
+	}
+	return 0;
+}
+
+/* fans without a tach = LABEL take the remaining fan sensors in order */
+static void nas_fan_tach_init(void) {
+	int id = -1;
+
+	for (int i = 0; i < nas_fan_count; i++) {
+		struct nas_fan *fan = nas_fans + i;
+
+		if (fan->tach == -2) {
+			do
+				id = nas_sensor_next_fan(id);
+			while ((id >= 0) && nas_fan_tach_used(id));
+			fan->tach = id;
+		}
+
+		if (fan->tach >= 0)
+			syslog(LOG_INFO, "fan %s: tachometer %s", fan->name, nas_sensor_label(fan->tach));
+		else
+			syslog(LOG_INFO, "fan %s: no tachometer", fan->name);
+	}
+}
+
+/* worst: the worst state of all fans, their outputs are boosted while it is not ok */
+static void nas_fan_tach_check(struct nas_fan *fan, const int worst) {
+	if (fan->tach < 0)
+		return;
+
+	fan->rpm = nas_sensor_value(fan->tach);
+	if (fan->settle > 0) {
+		fan->settle--;
+		return;
+	}
+
+	int b = fan->last * NAS_FAN_TACH_BUCKETS / 256;
+	double expect = fan->samples[b] >= tach_learn_min ? fan->curve[b] : NAN;
+	int state = NAS_FAN_OK;
+
+	if ((fan->rpm < 1) && (isnan(expect) ? fan->last >= tach_stall_pwm : expect >= 1))
+		state = NAS_FAN_STALLED;
+	else if (!isnan(expect) && (fan->rpm < expect * (1 - tach_drift_ratio)))
+		state = NAS_FAN_DEGRADED;
+
+	/*
+	 * learn only from normal readings of a healthy fan set by its own
+	 * controllers: a clogging fan must not become the norm, nor the RPM of
+	 * a degraded one boosted into buckets it never reached before
+	 */
+	if ((state == NAS_FAN_OK) && (fan->state == NAS_FAN_OK) && (worst == NAS_FAN_OK) &&
+	    (isnan(expect) || (fan->rpm <= expect * (1 + tach_drift_ratio)))) {
+		if (fan->samples[b] == 0)
+			fan->curve[b] = fan->rpm;
+		else
+			fan->curve[b] += tach_learn_alpha * (fan->rpm - fan->curve[b]);
+		if (fan->samples[b] < 0xFFFF)
+			fan->samples[b]++;
+	}
+
+	if (state == NAS_FAN_OK) {
+		fan->bad_count = 0;
+		if (fan->state == NAS_FAN_OK)
+			return;
+		/* the boost may bring it into an unlearned bucket, one good reading proves nothing */
+		if (++fan->ok_count >= tach_recover_ticks) {
+			syslog(LOG_NOTICE, "fan %s: back to normal, %.0f RPM at pwm %d", fan->name, fan->rpm, fan->last);
+			fan->state = NAS_FAN_OK;
+			fan->ok_count = 0;
+		}
+		return;
+	}
+
+	fan->ok_count = 0;
+	if (state == fan->state)
+		return;
+
+	fan->bad_count++;
+	if (fan->bad_count >= (state == NAS_FAN_STALLED ? tach_stall_ticks : tach_drift_ticks)) {
+		syslog(state == NAS_FAN_STALLED ? LOG_ALERT : LOG_WARNING,
+		       "fan %s: %s, %.0f RPM at pwm %d, expect %.0f", fan->name, nas_fan_state_names[state],
+		       fan->rpm, fan->last, expect);
+		fan->state = state;
+		fan->bad_count = 0;
+	}
+}
+
+static int nas_fan_find(const char *name) {
+	for (int i = 0; i < nas_fan_count; i++) {
+		if (strcmp(nas_fans[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* comma separated fan names to a bit mask, 0 on unknown names */
+static unsigned int nas_fan_parse_zones(const char *list) {
+	unsigned int zones = 0;
+	char name[sizeof(nas_fans[0].name)];
+
+	while (*list != '\0') {
+		size_t len = strcspn(list, ", ");
+		if (len > 0) {
+			snprintf(name, sizeof(name), "%.*s", (int)len, list);
+			int id = nas_fan_find(name);
+			if (id < 0) {
+				syslog(LOG_ERR, "unknown fan %s", name);
+				return 0;
+			}
+			zones |= 1u << id;
+		}
+		list += len;
+		while ((*list == ' ') || (*list == ','))
+			list++;
+	}
+	return zones;
+}
+
+static struct nas_fan_ctrl *nas_fan_ctrl_add(const char *name, const int input, const int sensor) {
+	struct nas_fan_ctrl *p = realloc(nas_fan_ctrls, sizeof(*p) * (nas_fan_ctrl_count + 1));
+	if (p == NULL) {
+		syslog(LOG_ERR, "allocate memory for fan controllers failed: %d", errno);
+		exit(EXIT_FAILURE);
+	}
+	nas_fan_ctrls = p;
+
+	p += nas_fan_ctrl_count++;
+	memset(p, 0, sizeof(*p));
+	snprintf(p->name, sizeof(p->name), "%s", name);
+	p->input = input;
+	p->sensor = sensor;
+	p->zones = (1u << nas_fan_count) - 1;
+	p->target = NAN;
+	p->last_temp = NAN;
+	return p;
+}
+
+static struct nas_fan_ctrl *nas_fan_ctrl_find(const char *name) {
+	for (int i = 0; i < nas_fan_ctrl_count; i++) {
+		if (strcmp(nas_fan_ctrls[i].name, name) == 0)
+			return nas_fan_ctrls + i;
+	}
+	return NULL;
+}
+
+/* the linear curve of the old policy, full speed from halt */
+static void nas_fan_ctrl_linear(struct nas_fan_ctrl *p, const double notice, const double halt) {
+	p->points = 2;
+	p->curve[0].temp = notice;
+	p->curve[0].pwm = 0;
+	p->curve[1].temp = halt;
+	p->curve[1].pwm = 255;
+}
+
+/* "TEMP:PWM, ..." with ascending temperatures */
+static int nas_fan_ctrl_parse_curve(struct nas_fan_ctrl *p, const char *curve) {
+	const char *s = curve;
+	char *end;
+
+	p->points = 0;
+	while (*s != '\0') {
+		if (p->points >= NAS_FAN_CURVE_POINTS)
+			return -1;
+
+		struct nas_fan_point *pt = p->curve + p->points;
+		pt->temp = strtod(s, &end);
+		if ((end == s) || (*end != ':'))
+			return -1;
+		s = end + 1;
+		pt->pwm = strtod(s, &end);
+		if ((end == s) || (pt->pwm < 0) || (pt->pwm > 255))
+			return -1;
+		if ((p->points > 0) && (pt->temp <= pt[-1].temp))
+			return -1;
+		p->points++;
+
+		s = end;
+		while ((*s == ' ') || (*s == ','))
+			s++;
+	}
+
+	return p->points > 0 ? 0 : -1;
+}
+
+/* a controller with the default curve of its input, NULL if no such input */
+static struct nas_fan_ctrl *nas_fan_ctrl_new(const char *input) {
+	struct nas_fan_ctrl *p;
+
+	if (strcmp(input, "hdd") == 0) {
+		p = nas_fan_ctrl_add(input, NAS_FAN_INPUT_HDD, -1);
+		nas_fan_ctrl_linear(p, hdd_temp_notice, hdd_temp_halt);
+	} else if (strcmp(input, "ssd") == 0) {
+		p = nas_fan_ctrl_add(input, NAS_FAN_INPUT_SSD, -1);
+		nas_fan_ctrl_linear(p, ssd_temp_notice, ssd_temp_halt);
+	} else if (strncmp(input, "disk:", 5) == 0) {
+		/* individual disks or bays, e.g. disk:sd[a-d]; SSDs use an explicit curve */
+		p = nas_fan_ctrl_add(input, NAS_FAN_INPUT_DISK, -1);
+		nas_fan_ctrl_linear(p, hdd_temp_notice, hdd_temp_halt);
+	} else {
+		int id = nas_sensor_find(input);
+		if (id < 0) {
+			syslog(LOG_WARNING, "fan_control: sensor %s not found, skip", input);
+			return NULL;
+		}
+
+		double notice, halt;
+		nas_sensor_limits(id, &notice, &halt);
+		p = nas_fan_ctrl_add(input, NAS_FAN_INPUT_SENSOR, id);
+		/* no default curve without a halt above notice, the section must give one */
+		if (halt > notice)
+			nas_fan_ctrl_linear(p, notice, halt);
+	}
+	return p;
+}
+
+/*
+ * one [fan_control] section per controller:
+ *   input = CPU             sensor label, hdd, ssd or disk:PATTERN
+ *   fans = cpu, cage        fans it drives, default all
+ *   curve = 40:0, 70:255    fan curve, TEMP:PWM points
+ *   target = 55             optional, enables the PID correction
+ *   kp = 8, ki = 0.1, kd = 40
+ */
+static void nas_fan_ctrl_load_conf(void) {
+	for (int sec = nas_conf_next("fan_control", -1); sec >= 0; sec = nas_conf_next("fan_control", sec)) {
+		const char *input = nas_conf_get(sec, "input");
+		const char *curve = nas_conf_get(sec, "curve");
+		const char *fans = nas_conf_get(sec, "fans");
+		struct nas_fan_ctrl *p;
+
+		if (input == NULL) {
+			syslog(LOG_ERR, "fan_control: missing input");
+			exit(EXIT_FAILURE);
+		}
+
+		/* a later section of the same input refines it, e.g. --config over the tuning file */
+		if (((p = nas_fan_ctrl_find(input)) == NULL) && ((p = nas_fan_ctrl_new(input)) == NULL))
+			continue;
+
+		if ((curve != NULL) && (nas_fan_ctrl_parse_curve(p, curve) != 0)) {
+			syslog(LOG_ERR, "fan_control %s: invalid curve: %s", input, curve);
+			exit(EXIT_FAILURE);
+		}
+		if (p->points == 0) {
+			/* only the controller just added can lack a curve */
+			syslog(LOG_WARNING, "fan_control %s: no halt temperature, needs a curve, skip", input);
+			nas_fan_ctrl_count--;
+			continue;
+		}
+
+		if ((fans != NULL) && ((p->zones = nas_fan_parse_zones(fans)) == 0)) {
+			syslog(LOG_ERR, "fan_control %s: invalid fans: %s", input, fans);
+			exit(EXIT_FAILURE);
+		}
 
-	if ((abs(pwm_last - pwm) > pwm_update_threshold) ||
-	    (pwm_skip_count > pwm_skip_max)) {
-		nas_fan_output(pwm);
-		pwm_last = pwm;
-		pwm_skip_count = 0;
-	} else
-		pwm_skip_count++;
+		p->target = nas_conf_get_double(sec, "target", p->target);
+		p->kp = nas_conf_get_double(sec, "kp", p->kp);
+		p->ki = nas_conf_get_double(sec, "ki", p->ki);
+		p->kd = nas_conf_get_double(sec, "kd", p->kd);
+	}
+}
+
+static void nas_fan_ctrl_init(void) {
+	nas_fan_ctrl_load_conf();
+
+	/* same inputs and curves as before the controllers */
+	if (nas_fan_ctrl_count == 0) {
+		double notice, halt;
+
+		for (int id = nas_sensor_next_thermal(-1); id >= 0; id = nas_sensor_next_thermal(id)) {
+			nas_sensor_limits(id, &notice, &halt);
+			if (halt > notice)
+				nas_fan_ctrl_linear(nas_fan_ctrl_add(nas_sensor_label(id), NAS_FAN_INPUT_SENSOR, id),
+						    notice, halt);
+		}
+		nas_fan_ctrl_linear(nas_fan_ctrl_add("hdd", NAS_FAN_INPUT_HDD, -1), hdd_temp_notice, hdd_temp_halt);
+		nas_fan_ctrl_linear(nas_fan_ctrl_add("ssd", NAS_FAN_INPUT_SSD, -1), ssd_temp_notice, ssd_temp_halt);
+	}
+
+	for (int i = 0; i < nas_fan_ctrl_count; i++) {
+		const struct nas_fan_ctrl *p = nas_fan_ctrls + i;
+		syslog(LOG_INFO, "fan control %s: fans 0x%x, %d curve point(s) %.0f:%.0f .. %.0f:%.0f, "
+				 "target %.1f, kp %g, ki %g, kd %g", p->name, p->zones, p->points,
+		       p->curve[0].temp, p->curve[0].pwm, p->curve[p->points - 1].temp, p->curve[p->points - 1].pwm,
+		       p->target, p->kp, p->ki, p->kd);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &nas_fan_ts);
+}
+
+static double nas_fan_ctrl_input(const struct nas_fan_ctrl *p) {
+	switch (p->input) {
+		case NAS_FAN_INPUT_HDD:
+			return nas_disk_get_temp(0);
+		case NAS_FAN_INPUT_SSD:
+			return nas_disk_get_temp(1);
+		case NAS_FAN_INPUT_DISK:
+			return nas_disk_match_temp(p->name + 5);
+		default:
+			return nas_sensor_value(p->sensor);
+	}
+}
+
+static double nas_fan_curve(const struct nas_fan_ctrl *p, const double t) {
+	const struct nas_fan_point *pt = p->curve;
+
+	if (t <= pt[0].temp)
+		return pt[0].pwm;
+
+	for (int i = 1; i < p->points; i++) {
+		if (t < pt[i].temp)
+			return pt[i - 1].pwm + (pt[i].pwm - pt[i - 1].pwm) *
+					       (t - pt[i - 1].temp) / (pt[i].temp - pt[i - 1].temp);
+	}
+	return pt[p->points - 1].pwm;
+}
+
+static double nas_fan_ctrl_step(struct nas_fan_ctrl *p, const double t, const double dt) {
+	double u = nas_fan_curve(p, t);
+
+	if (!isnan(p->target)) {
+		double e = t - p->target;
+
+		/* derivative on measurement, no kick on target change, low-pass against sensor noise */
+		if (!isnan(p->last_temp) && (dt > 0))
+			p->slope = 0.5 * p->slope + 0.5 * (t - p->last_temp) / dt;
+
+		u += p->kp * e + p->ki * p->integral + p->kd * p->slope;
+
+		/* anti-windup: only integrate while the output is not saturated by the same sign */
+		if (!(((u >= 255) && (e > 0)) || ((u <= 0) && (e < 0)))) {
+			p->integral += e * dt;
+			if (p->ki > 0) {
+				double limit = 255 / p->ki;
+				if (p->integral > limit)
+					p->integral = limit;
+				else if (p->integral < -limit)
+					p->integral = -limit;
+			}
+		}
+	}
+	p->last_temp = t;
+
+	if (u < 0)
+		u = 0;
+	else if (u > 255)
+		u = 255;
+
+	p->output = u;
+	return u;
+}
+
+/*
+ * --fan=DEV[,DEV...] names the fans fan1, fan2, ...; [fan] sections in
+ * the config file add named ones: name = cage, pwm = /sys/.../pwm2
+ */
+void nas_fan_init(const char *devs) {
+	char name[sizeof(nas_fans[0].name)];
+
+	atexit(nas_fan_free);
+
+	if (devs != NULL) {
+		char *list = strdup(devs);
+		char *save = NULL;
+
+		if (list == NULL) {
+			syslog(LOG_ERR, "allocate memory for fan list failed: %d", errno);
+			exit(EXIT_FAILURE);
+		}
+		for (char *dev = strtok_r(list, ",", &save); dev != NULL; dev = strtok_r(NULL, ",", &save)) {
+			snprintf(name, sizeof(name), "fan%d", nas_fan_count + 1);
+			nas_fan_open(name, dev);
+		}
+		free(list);
+	}
+
+	for (int sec = nas_conf_next("fan", -1); sec >= 0; sec = nas_conf_next("fan", sec)) {
+		const char *pwm = nas_conf_get(sec, "pwm");
+		const char *label = nas_conf_get(sec, "name");
+		const char *tach = nas_conf_get(sec, "tach");
+
+		if (pwm == NULL) {
+			syslog(LOG_ERR, "fan: missing pwm");
+			exit(EXIT_FAILURE);
+		}
+		if (label == NULL) {
+			snprintf(name, sizeof(name), "fan%d", nas_fan_count + 1);
+			label = name;
+		}
+		nas_fan_open(label, pwm);
+
+		if (tach != NULL) {
+			struct nas_fan *fan = nas_fans + nas_fan_count - 1;
+			if (strcmp(tach, "none") == 0)
+				fan->tach = -1;
+			else if ((fan->tach = nas_sensor_find(tach)) < 0)
+				syslog(LOG_WARNING, "fan %s: tachometer %s not found", fan->name, tach);
+		}
+	}
+
+	if (nas_fan_count == 0) {
+		syslog(LOG_ERR, "no fan configured");
+		exit(EXIT_FAILURE);
+	}
+
+	nas_fan_tach_init();
+	nas_fan_ctrl_init();
+}
+
+void nas_fan_update(void) {
+	double dt = nas_elapsed_ms(&nas_fan_ts) / 1000.0;
+	double out[NAS_FAN_MAX];
+
+	clock_gettime(CLOCK_MONOTONIC, &nas_fan_ts);
+	memset(out, 0, sizeof(out));
+
+	/* the hottest input of a zone wins */
+	for (int i = 0; i < nas_fan_ctrl_count; i++) {
+		struct nas_fan_ctrl *p = nas_fan_ctrls + i;
+		double t = nas_fan_ctrl_input(p);
+
+		if (isnan(t))
+			continue;
+
+		double u = nas_fan_ctrl_step(p, t, dt);
+		for (int j = 0; j < nas_fan_count; j++) {
+			if ((p->zones & (1u << j)) && (u > out[j]))
+				out[j] = u;
+		}
+#ifndef NDEBUG
+		syslog(LOG_DEBUG, "fan control %s: temp %.2f, slope %.3f, integral %.1f, pwm %.1f",
+		       p->name, t, p->slope, p->integral, u);
+#endif
+	}
+
+	/* cover for an under-performing fan with the others and a lower CPU clock */
+	int worst = NAS_FAN_OK;
+	for (int i = 0; i < nas_fan_count; i++) {
+		if (nas_fans[i].state > worst)
+			worst = nas_fans[i].state;
+	}
+	for (int i = 0; (worst != NAS_FAN_OK) && (i < nas_fan_count); i++) {
+		if (worst == NAS_FAN_STALLED)
+			out[i] = 255;
+		else if (out[i] + tach_boost < 255)
+			out[i] += tach_boost;
+		else
+			out[i] = 255;
+	}
+	for (int i = 0; i < nas_fan_count; i++) {
+		if (out[i] < nas_fan_floor)
+			out[i] = nas_fan_floor;
+	}
+	cpu_freq_cap(NAS_CPU_CAP_FAN, worst == NAS_FAN_STALLED ? NAS_CPU_FREQ_LOW :
+				      worst == NAS_FAN_DEGRADED ? NAS_CPU_FREQ_HIGH : NAS_CPU_FREQ_MAX);
+
+	for (int i = 0; i < nas_fan_count; i++) {
+		struct nas_fan *fan = nas_fans + i;
+		int pwm = (int)lround(out[i]);
+		int delta = abs(fan->last - pwm);
+
+		/* small steps are batched, the limits are always reached exactly */
+		if ((delta > pwm_update_threshold) ||
+		    ((delta != 0) && ((pwm == 0) || (pwm == 255) || (fan->skip_count > pwm_skip_max)))) {
+			nas_fan_output(fan, pwm);
+			fan->last = pwm;
+			fan->skip_count = 0;
+			fan->settle = tach_settle_ticks;
+		} else
+			fan->skip_count++;
+
+		nas_fan_tach_check(fan, worst);
+	}
+}
+
+/* PWM left on the fan closest to full speed */
+int nas_fan_headroom(void) {
+	int headroom = 255;
+	for (int i = 0; i < nas_fan_count; i++) {
+		if (255 - nas_fans[i].last < headroom)
+			headroom = 255 - nas_fans[i].last;
+	}
+	return headroom;
+}
+
+void nas_fan_set_floor(const int pwm) {
+	nas_fan_floor = pwm;
+}
+
+/* controller inputs and a fixed duty for all fans, used by the calibration */
+int nas_fan_inputs(void) {
+	return nas_fan_ctrl_count;
+}
+
+const char *nas_fan_input_name(const int id) {
+	return nas_fan_ctrls[id].name;
+}
+
+double nas_fan_input_temp(const int id) {
+	return nas_fan_ctrl_input(nas_fan_ctrls + id);
+}
+
+/* temperatures of the first and the last curve points */
+void nas_fan_input_range(const int id, double *low, double *high) {
+	const struct nas_fan_ctrl *p = nas_fan_ctrls + id;
+	*low = p->curve[0].temp;
+	*high = p->curve[p->points - 1].temp;
+}
+
+void nas_fan_force(const int pwm) {
+	for (int i = 0; i < nas_fan_count; i++) {
+		if (nas_fans[i].last != pwm) {
+			nas_fan_output(nas_fans + i, pwm);
+			nas_fans[i].last = pwm;
+		}
+	}
+}
+
+int nas_fan_to_json(char *buf, const size_t len) {
+	int count = 0;
+	for (int i = 0; i < nas_fan_count; i++) {
+		const struct nas_fan *fan = nas_fans + i;
+
+		if (i != 0)
+			buf[count++] = ',';
+		count += snprintf(buf + count, len - count, "\"%s\":{\"PWM\":%d", fan->name, fan->last);
+		if (fan->tach >= 0) {
+			count += snprintf(buf + count, len - count, ",\"RPM\":%.0f,\"State\":\"%s\",\"Curve\":[",
+					  fan->rpm, nas_fan_state_names[fan->state]);
+			/* learned PWM -> RPM points, at the bucket centers */
+			int n = 0;
+			for (int b = 0; b < NAS_FAN_TACH_BUCKETS; b++) {
+				if (fan->samples[b] < tach_learn_min)
+					continue;
+				count += snprintf(buf + count, len - count, "%s[%d,%.0f]", n++ ? "," : "",
+						  (2 * b + 1) * 128 / NAS_FAN_TACH_BUCKETS, fan->curve[b]);
+			}
+			buf[count++] = ']';
+		}
+		buf[count++] = '}';
+	}
+	return count;
 }
@@ -0,0 +1,272 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#include "nasmon.h"
+
+/*
+ * Predictive thermal guard: fit a line over the last samples of each
+ * temperature with a shutdown limit and extrapolate when it crosses the
+ * limit. Well before that the fans go to full speed and the CPU is
+ * capped; if the crossing is still coming, the box is shut down cleanly
+ * instead of after the limit is already exceeded.
+ */
+
+#define GUARD_WINDOW 36     /* samples in the fit, guard_span of 5 second ticks */
+
+static const time_t guard_span = 180;           /* seconds of samples in the fit, at least */
+static const int guard_min_samples = 6;         /* the span of a slower input covers as many polls */
+static const double guard_warn_ttl = 600;       /* seconds to the limit */
+static const double guard_shutdown_ttl = 120;
+static const double guard_clear_ttl = 900;      /* hysteresis of the warning */
+static const int guard_confirm_ticks = 3;
+
+enum {
+	NAS_GUARD_OK,
+	NAS_GUARD_WARN,
+	NAS_GUARD_SHUTDOWN
+};
+
+static const char *const nas_guard_level_names[] = {"ok", "warn", "shutdown"};
+
+enum {
+	NAS_GUARD_SENSOR,
+	NAS_GUARD_HDD,
+	NAS_GUARD_SSD
+};
+
+struct nas_guard_input {
+	char name[32];
+	int type;
+	int sensor;
+	int can_halt;       /* crossing the limit shuts the box down */
+	double limit;
+	time_t span;        /* samples older than this leave the fit */
+	unsigned long gen;  /* of the last reading taken */
+	int disks;          /* the hottest disk was one of these */
+	double temp[GUARD_WINDOW];
+	time_t ts[GUARD_WINDOW];
+	int pos;
+	int filled;
+	double slope;       /* C/s */
+	double ttl;         /* seconds to the limit at fit_ts, INFINITY if not rising */
+	time_t fit_ts;
+	int level;
+	int confirm;
+};
+
+static int nas_guard_count = 0;
+static struct nas_guard_input *nas_guard_inputs = NULL;
+static int nas_guard_level = NAS_GUARD_OK;
+static int nas_guard_clear = 0;
+
+static void nas_guard_free(void) {
+	free(nas_guard_inputs);
+}
+
+/* interval is the seconds between two readings of the input, 0 for every tick */
+static void nas_guard_add(const char *name, const int type, const int sensor, const double limit,
+			  const int can_halt, const time_t interval) {
+	struct nas_guard_input *p = realloc(nas_guard_inputs, sizeof(*p) * (nas_guard_count + 1));
+	if (p == NULL) {
+		syslog(LOG_ERR, "allocate memory for thermal guard failed: %d", errno);
+		exit(EXIT_FAILURE);
+	}
+	nas_guard_inputs = p;
+
+	p += nas_guard_count++;
+	memset(p, 0, sizeof(*p));
+	snprintf(p->name, sizeof(p->name), "%s", name);
+	p->type = type;
+	p->sensor = sensor;
+	p->limit = limit;
+	p->can_halt = can_halt;
+	p->span = guard_min_samples * interval > guard_span ? guard_min_samples * interval : guard_span;
+	p->ttl = INFINITY;
+
+	syslog(LOG_INFO, "thermal guard %s: limit %.1f%s, fit over %lds", p->name, limit, can_halt ? ", shutdown" : "",
+	       (long)p->span);
+}
+
+void nas_guard_init(void) {
+	atexit(nas_guard_free);
+
+	/* a sensor with a high limit shuts down there, one without only escalates before halt */
+	for (int id = nas_sensor_next_thermal(-1); id >= 0; id = nas_sensor_next_thermal(id)) {
+		double notice, halt, max = nas_sensor_max(id);
+
+		nas_sensor_limits(id, &notice, &halt);
+		if (max != 0)
+			nas_guard_add(nas_sensor_label(id), NAS_GUARD_SENSOR, id, max, 1, nas_sensor_interval(id));
+		else if (halt > notice)
+			nas_guard_add(nas_sensor_label(id), NAS_GUARD_SENSOR, id, halt, 0, nas_sensor_interval(id));
+	}
+	nas_guard_add("hdd", NAS_GUARD_HDD, -1, hdd_temp_halt, 1, smart_hdd_update_interval);
+	nas_guard_add("ssd", NAS_GUARD_SSD, -1, ssd_temp_halt, 1, smart_update_interval);
+}
+
+/* least squares slope over the window */
+static double nas_guard_slope(const struct nas_guard_input *p) {
+	double st = 0, sy = 0, stt = 0, sty = 0;
+	time_t t0 = p->ts[(p->pos + GUARD_WINDOW - p->filled) % GUARD_WINDOW];
+
+	for (int i = 0; i < p->filled; i++) {
+		int k = (p->pos + GUARD_WINDOW - p->filled + i) % GUARD_WINDOW;
+		double t = (double)(p->ts[k] - t0);
+		st += t;
+		sy += p->temp[k];
+		stt += t * t;
+		sty += t * p->temp[k];
+	}
+
+	double d = p->filled * stt - st * st;
+	return d > 0 ? (p->filled * sty - st * sy) / d : 0;
+}
+
+/* seconds to the limit now, the last fit carried forward */
+static double nas_guard_ttl(const struct nas_guard_input *p, const time_t now) {
+	double ttl = p->ttl - (double)(now - p->fit_ts);
+	return ttl > 0 ? ttl : 0;
+}
+
+/* 1 if the input was read again since the last call and the fit is new */
+static int nas_guard_sample(struct nas_guard_input *p, const time_t now) {
+	unsigned long gen;
+	int disks = 1;
+	double t;
+
+	switch (p->type) {
+		case NAS_GUARD_HDD:
+			t = nas_disk_guard_temp(0, &gen, &disks);
+			break;
+		case NAS_GUARD_SSD:
+			t = nas_disk_guard_temp(1, &gen, &disks);
+			break;
+		default:
+			t = nas_sensor_value(p->sensor);
+			gen = nas_sensor_reads(p->sensor);
+			break;
+	}
+
+	/* the same reading again would flatten the fit */
+	if (gen == p->gen)
+		return 0;
+	p->gen = gen;
+	p->fit_ts = now;
+
+	/* no disk read, or the hottest of another set of disks: a step, not a trend */
+	if (!(t > 0) || (disks != p->disks)) {
+		p->filled = 0;
+		p->disks = disks;
+	}
+	while ((p->filled > 0) && (p->ts[(p->pos + GUARD_WINDOW - p->filled) % GUARD_WINDOW] < now - p->span))
+		p->filled--;
+
+	p->ttl = INFINITY;
+	p->slope = 0;
+	if (!(t > 0))
+		return 1;
+
+	p->temp[p->pos] = t;
+	p->ts[p->pos] = now;
+	p->pos = (p->pos + 1) % GUARD_WINDOW;
+	if (p->filled < GUARD_WINDOW)
+		p->filled++;
+
+	if (p->filled < guard_min_samples)
+		return 1;
+
+	p->slope = nas_guard_slope(p);
+	if (t >= p->limit)
+		p->ttl = 0;
+	else if (p->slope > 0)
+		p->ttl = (p->limit - t) / p->slope;
+	return 1;
+}
+
+/* !0 to shut down now */
+int nas_guard_update(const time_t now) {
+	int level = NAS_GUARD_OK;
+	int err = 0;
+	int clear = 1;
+
+	for (int i = 0; i < nas_guard_count; i++) {
+		struct nas_guard_input *p = nas_guard_inputs + i;
+		int want = NAS_GUARD_OK;
+
+		int fresh = nas_guard_sample(p, now);
+		double ttl = nas_guard_ttl(p, now);
+		if ((ttl < guard_shutdown_ttl) && p->can_halt)
+			want = NAS_GUARD_SHUTDOWN;
+		else if (ttl < guard_warn_ttl)
+			want = NAS_GUARD_WARN;
+		if (ttl < guard_clear_ttl)
+			clear = 0;
+
+		/* a few fits in a row, one noisy fit must not halt the box */
+		if (want > p->level) {
+			if (fresh && (++p->confirm >= guard_confirm_ticks)) {
+				p->level = want;
+				p->confirm = 0;
+				syslog(want == NAS_GUARD_SHUTDOWN ? LOG_EMERG : LOG_ALERT,
+				       "thermal guard %s: %.1fC rising %.2fC/min, limit %.1fC in %.0fs",
+				       p->name, p->temp[(p->pos + GUARD_WINDOW - 1) % GUARD_WINDOW], p->slope * 60,
+				       p->limit, ttl);
+			}
+		} else {
+			p->confirm = 0;
+			if (want < p->level)
+				p->level = want;
+		}
+
+		if (p->level > level)
+			level = p->level;
+		if (p->level == NAS_GUARD_SHUTDOWN)
+			err++;
+	}
+
+	if (level > nas_guard_level) {
+		nas_guard_level = level;
+		nas_guard_clear = 0;
+		nas_fan_set_floor(255);
+		cpu_freq_cap(NAS_CPU_CAP_THERMAL, NAS_CPU_FREQ_MIN);
+	} else if ((nas_guard_level != NAS_GUARD_OK) && (level == NAS_GUARD_OK)) {
+		/* hold the escalation until every input is well clear */
+		nas_guard_clear = clear ? nas_guard_clear + 1 : 0;
+		if (nas_guard_clear >= guard_confirm_ticks) {
+			syslog(LOG_NOTICE, "thermal guard: temperatures recovered");
+			nas_guard_level = NAS_GUARD_OK;
+			nas_fan_set_floor(0);
+			cpu_freq_cap(NAS_CPU_CAP_THERMAL, NAS_CPU_FREQ_MAX);
+		}
+	}
+
+	if (err != 0)
+		syslog(LOG_EMERG, "thermal guard: limit predicted within %.0fs, shutdown", guard_shutdown_ttl);
+	return err;
+}
+
+int nas_guard_to_json(char *buf, const size_t len) {
+	int count = snprintf(buf, len, "\"Level\":\"%s\",\"Inputs\":{", nas_guard_level_names[nas_guard_level]);
+
+	for (int i = 0; i < nas_guard_count; i++) {
+		const struct nas_guard_input *p = nas_guard_inputs + i;
+
+		count += snprintf(buf + count, len - count, "%s\"%s\":{\"Limit\":%.1f,\"Slope\":%.3f,\"TTL\":",
+				  i ? "," : "", p->name, p->limit, p->slope * 60);
+		if (isinf(p->ttl))
+			count += snprintf(buf + count, len - count, "null");
+		else
+			count += snprintf(buf + count, len - count, "%.0f", p->ttl);
+		count += snprintf(buf + count, len - count, ",\"Level\":\"%s\"}", nas_guard_level_names[p->level]);
+	}
+	buf[count++] = '}';
+	return count;
+}
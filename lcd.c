@@ -13,8 +13,6 @@
 
 #include "nasmon.h"
 
-#define LCD_LINE_CHARS  16
-
 static int lcd_status = 0;
 static int lcd_fd = -1;
 static char lcd_buf[40];
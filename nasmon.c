@@ -32,7 +32,8 @@
 #define POWEROFF_EVENT_INTERVAL  2
 #define POWEROFF_EVENT_TIMEOUT  10
 #define PRESENT_TIMEOUT 30
-#define MAX_EVENTS 3
+#define MAX_EVENTS 8
+#define MAX_ALARMS 32
 
 #define makestr(s)  #s
 
@@ -41,6 +42,7 @@ enum lcd_ctrl_type {
 	LCD_INFO_DISK,
 	LCD_INFO_SYSLOAD,
 	LCD_INFO_IFS,
+	LCD_INFO_RAID,
 	LCD_INFO_CLOCK,
 	LCD_INFO_SUMMARY,
 	LCD_CPU_FREQ,
@@ -55,13 +57,18 @@ static time_t pwr_ts = 0;
 static time_t present_ts = 0;
 static int pwr_repeats = 0;
 static int info_major_index = LCD_INFO_SUMMARY;
+static int nas_epoll_fd = -1;
 
 static const char *model = NULL;
 static const char *power_event_device = NULL;
 static const char *button_event_device = NULL;
 static const char *nic_list = NULL;
 static const char *sensors_conf = NULL;
+static const char *nasmon_conf = NULL;
 static const char *fan_device = NULL;
+static const char *fan_tuning = "/var/lib/nasmon/fan-tuning.conf";
+static const char *calibrate_file = NULL;
+static int calibrate_step = 600;
 static const char *shutdown_bin;
 
 static void print_event(const struct input_event *restrict pe) {
@@ -159,6 +166,9 @@ static void show_summary_info(const int off) {
 		case LCD_INFO_IFS:
 			nas_ifs_summary_show();
 			break;
+		case LCD_INFO_RAID:
+			nas_raid_summary_show();
+			break;
 		case LCD_INFO_CLOCK:
 			nas_show_clock();
 		default:
@@ -180,6 +190,9 @@ static void nas_handle_event(const int page_switch, const int off) {
 		case LCD_INFO_IFS:
 			nas_ifs_item_show(off);
 			break;
+		case LCD_INFO_RAID:
+			nas_raid_item_show(off);
+			break;
 		case LCD_INFO_SUMMARY:
 			show_summary_info(off);
 			break;
@@ -249,8 +262,16 @@ static void usage(const char *restrict name) {
 	       "\t--power=DEV\tpower event device (/dev/input/event?)\n"
 	       "\t--buttons=DEV\tfront board buttons event device (/dev/input/event?)\n"
 	       "\t--sensors=FILE\tsensors config file>\n"
-	       "\t--fan=DEV\tsystem fan device\n"
+	       "\t--bench_sensors=N\ttime N rounds of sensor reads via sysfs and libsensors, then exit\n"
+	       "\t--config=FILE\tnasmon config file, e.g. [sensor] sections\n"
+	       "\t--fan=DEV1,...\tsystem fan devices, more in [fan] sections of the config\n"
+	       "\t--fan_tuning=FILE\tcalibrated fan controllers, loaded before --config (default: %s)\n"
+	       "\t--calibrate=FILE\tstep the fans, fit a thermal model, write the tuning to FILE and exit\n"
+	       "\t--calibrate_step=SEC\tduration of one calibration step (default: %d)\n"
 	       "\t--nics=NIC1,...,NICn\tnetwork interfaces (comma separated names)\n"
+	       "\t--disk_cache=FILE\tdisk identity cache (default: %s)\n"
+	       "\t--disk_probe_workers=N\tparallel disk probes at startup (default: %d)\n"
+	       "\t--spindown=DEV:SEC,...\tspin down idle hard disks, * for any disk (default: off)\n"
 	       "\t--temp_cpu_notice=TEMP\tfan bump temperature(C) for CPU (default: %.0f)\n"
 	       "\t--temp_cpu_high=TEMP\thalt temperature(C) for CPU (default: %.0f)\n"
 	       "\t--temp_sys_notice=TEMP\tfan bump temperature(C) for mother board (default: %.0f)\n"
@@ -258,7 +279,7 @@ static void usage(const char *restrict name) {
 	       "\t--temp_hdd_high=TEMP\thalt temperature(C) for hard disk (default: %d)\n"
 	       "\t--temp_ssd_notice=TEMP\tfan bump temperature(C) for SSD (default: %d)\n"
 	       "\t--temp_ssd_high=TEMP\thalt temperature(C) for SSD (default: %d)\n",
-	       name, cpu_temp_notice, cpu_temp_halt, sys_temp_notice,
+	       name, fan_tuning, calibrate_step, disk_cache_file, disk_probe_workers, cpu_temp_notice, cpu_temp_halt, sys_temp_notice,
 	       hdd_temp_notice, hdd_temp_halt, ssd_temp_notice, ssd_temp_halt);
 	exit(EXIT_FAILURE);
 }
@@ -269,10 +290,15 @@ static void signal_handler(int sig_num) {
 	/* SIGHUP: do nothing */
 }
 
-static int nas_add_event_fd(int epoll_fd, int fd) {
+static void nas_log_startup(const char *phase, struct timespec *ts) {
+	syslog(LOG_INFO, "startup: %s in %ld ms", phase, nas_elapsed_ms(ts));
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+static int nas_add_event_fd(int epoll_fd, int fd, uint32_t events) {
 	struct epoll_event ev;
 
-	ev.events = EPOLLIN;
+	ev.events = events;
 	ev.data.fd = fd;
 	int rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
 	if (rc < 0)
@@ -281,6 +307,18 @@ static int nas_add_event_fd(int epoll_fd, int fd) {
 	return rc;
 }
 
+/* a sysfs attribute opened once the main loop runs, e.g. of an md array assembled later */
+void nas_event_watch(const int fd) {
+	if (nas_epoll_fd >= 0)
+		nas_add_event_fd(nas_epoll_fd, fd, EPOLLPRI | EPOLLERR);
+}
+
+/* a watched sysfs attribute that went away, before its module closes it */
+void nas_event_unwatch(const int fd) {
+	if ((nas_epoll_fd >= 0) && (epoll_ctl(nas_epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0))
+		syslog(LOG_WARNING, "epoll_ctl del failed on file handler %d: %d", fd, errno);
+}
+
 /*
  * model: head -n1 /proc/readynas/model
  * pwr_event: grep '^P: Phys' /proc/bus/input/devices | nl -pv 0 |
@@ -295,6 +333,7 @@ int main(const int argc, char *const argv[]) {
 	const char *prog_name = nas_get_filename(argv[0]);
 	short listen_port = -1;
 	int daemon = 1;
+	int bench_rounds = 0;
 
 	while (1) {
 		static struct option long_options[] = {
@@ -305,8 +344,16 @@ int main(const int argc, char *const argv[]) {
 			{"power",           required_argument, 0, 'p'},
 			{"button",          required_argument, 0, 'b'},
 			{"sensors",         required_argument, 0, 's'},
+			{"bench_sensors",   required_argument, 0, 'B'},
+			{"config",          required_argument, 0, 'F'},
 			{"fan",             required_argument, 0, 'f'},
+			{"fan_tuning",      required_argument, 0, 'U'},
+			{"calibrate",       required_argument, 0, 'K'},
+			{"calibrate_step",  required_argument, 0, 'T'},
 			{"nics",            required_argument, 0, 'n'},
+			{"disk_cache",      required_argument, 0, 'C'},
+			{"disk_probe_workers", required_argument, 0, 'W'},
+			{"spindown",        required_argument, 0, 'S'},
 			{"temp_cpu_notice", required_argument, 0, 'c'},
 			{"temp_cpu_high",   required_argument, 0, 'd'},
 			{"temp_sys_notice", required_argument, 0, 'e'},
@@ -345,12 +392,36 @@ int main(const int argc, char *const argv[]) {
 			case 's':
 				sensors_conf = optarg;
 				break;
+			case 'B':
+				bench_rounds = strtol(optarg, NULL, 10);
+				break;
+			case 'F':
+				nasmon_conf = optarg;
+				break;
 			case 'f':
 				fan_device = optarg;
 				break;
+			case 'U':
+				fan_tuning = optarg;
+				break;
+			case 'K':
+				calibrate_file = optarg;
+				break;
+			case 'T':
+				calibrate_step = strtol(optarg, NULL, 10);
+				break;
 			case 'n':
 				nic_list = optarg;
 				break;
+			case 'C':
+				disk_cache_file = optarg;
+				break;
+			case 'W':
+				disk_probe_workers = strtol(optarg, NULL, 10);
+				break;
+			case 'S':
+				disk_spindown_list = optarg;
+				break;
 			case 'c':
 				cpu_temp_notice = strtol(optarg, NULL, 10);
 				break;
@@ -383,8 +454,10 @@ int main(const int argc, char *const argv[]) {
 	    (power_event_device == NULL) ||
 	    (button_event_device == NULL) ||
 	    (nic_list == NULL) ||
+#ifndef NAS_NO_LIBSENSORS
 	    (sensors_conf == NULL) ||
-	    (fan_device == NULL)) {
+#endif
+	    ((fan_device == NULL) && (nasmon_conf == NULL))) {
 		usage(prog_name);
 	}
 
@@ -409,7 +482,7 @@ int main(const int argc, char *const argv[]) {
 	int pwr_fd, fb_fd, sts_fd;
 	pid_t pid, sid;
 
-	if (daemon) {
+	if (daemon && (bench_rounds <= 0) && (calibrate_file == NULL)) {
 		/* Fork off the parent process */
 		if ((pid = fork()) < 0)
 			exit(EXIT_FAILURE);
@@ -450,13 +523,37 @@ int main(const int argc, char *const argv[]) {
 	if ((fb_fd = open(button_event_device, O_RDONLY)) < 0)
 		syslog(LOG_ERR, "Open front panel event device failed: %d", errno);
 
-	nas_sysload_update();
+	struct timespec phase_ts;
+	clock_gettime(CLOCK_MONOTONIC, &phase_ts);
+
+	/* the tuning first, so that --config can override it */
+	nas_conf_load_optional(fan_tuning);
+	nas_conf_load(nasmon_conf);
+	nas_sysload_init();
+	nas_psi_init();
+	nas_top_init();
 	nas_sensor_init(sensors_conf);
+	if (bench_rounds > 0) {
+		nas_sensor_bench(bench_rounds);
+		exit(EXIT_SUCCESS);
+	}
+	nas_log_startup("sensors", &phase_ts);
 	nas_ifs_init();
 	nas_fan_init(fan_device);
+	nas_log_startup("fan", &phase_ts);
+	/* the arrays first, their members are compared as peers */
+	nas_raid_init();
+	/* disks join the control loop as their probe finishes */
 	nas_disk_init();
+	nas_log_startup("disk scan", &phase_ts);
 	cpu_freq_init();
+	nas_guard_init();
+	if (calibrate_file != NULL) {
+		nas_calibrate(calibrate_file, calibrate_step);
+		exit(EXIT_SUCCESS);
+	}
 	sts_fd = nas_stssrv_init(listen_port);
+	nas_log_startup("status server", &phase_ts);
 
 	syslog(LOG_INFO, "start hardware monitor");
 	lcd_on();
@@ -469,23 +566,49 @@ int main(const int argc, char *const argv[]) {
 
 	struct input_event e;
 	struct timespec ts;
+	struct timespec tick_ts;
 	int nfds, timeout;
 
-	if (nas_add_event_fd(epoll_fd, pwr_fd) < 0)
+	if (nas_add_event_fd(epoll_fd, pwr_fd, EPOLLIN) < 0)
 		exit(EXIT_FAILURE);
 
-	if ((fb_fd >= 0) && (nas_add_event_fd(epoll_fd, fb_fd) < 0))
+	if ((fb_fd >= 0) && (nas_add_event_fd(epoll_fd, fb_fd, EPOLLIN) < 0))
 		exit(EXIT_FAILURE);
 
-	if (nas_add_event_fd(epoll_fd, sts_fd) < 0)
+	if (nas_add_event_fd(epoll_fd, sts_fd, EPOLLIN) < 0)
 		exit(EXIT_FAILURE);
 
-	while (keep_running != 0) {
-		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	/* hwmon drivers signal *_alarm changes with sysfs_notify, seen as EPOLLPRI */
+	int alarm_fds[MAX_ALARMS];
+	int alarms = nas_sensor_alarm_fds(alarm_fds, MAX_ALARMS);
+	for (int i = 0; i < alarms; i++) {
+		if (nas_add_event_fd(epoll_fd, alarm_fds[i], EPOLLPRI | EPOLLERR) < 0)
+			exit(EXIT_FAILURE);
+	}
+	syslog(LOG_INFO, "watch %d sensor alarm(s)", alarms);
+
+	/* so do md arrays on a degrade or a resync */
+	int raid_fds[MAX_ALARMS];
+	int raids = nas_raid_fds(raid_fds, MAX_ALARMS);
+	for (int i = 0; i < raids; i++) {
+		if (nas_add_event_fd(epoll_fd, raid_fds[i], EPOLLPRI | EPOLLERR) < 0)
+			exit(EXIT_FAILURE);
+	}
 
-		timeout = NAS_HW_SCAN_INTERVAL - 1 - (ts.tv_sec % NAS_HW_SCAN_INTERVAL);
-		timeout *= 1000;
-		timeout += (1000000000 - ts.tv_nsec) / 1000000;
+	/* PSI triggers fire as EPOLLPRI as well */
+	int psi_fds[NAS_PSI_RESOURCES];
+	int psis = nas_psi_fds(psi_fds, NAS_PSI_RESOURCES);
+	for (int i = 0; i < psis; i++) {
+		if (nas_add_event_fd(epoll_fd, psi_fds[i], EPOLLPRI | EPOLLERR) < 0)
+			exit(EXIT_FAILURE);
+	}
+
+	nas_epoll_fd = epoll_fd;
+	clock_gettime(CLOCK_MONOTONIC, &tick_ts);
+	while (keep_running != 0) {
+		/* the tick runs on elapsed time, a stream of events must not hold it off */
+		long elapsed = nas_elapsed_ms(&tick_ts);
+		timeout = elapsed < NAS_HW_SCAN_INTERVAL * 1000 ? NAS_HW_SCAN_INTERVAL * 1000 - (int)elapsed : 0;
 		nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
 
 		if (nfds < 0) {
@@ -496,48 +619,62 @@ int main(const int argc, char *const argv[]) {
 			break;
 		}
 
-		if (nfds == 0) {
-			clock_gettime(CLOCK_REALTIME_COARSE, &ts);
-
-			if ((nas_sensor_update(ts.tv_sec) != 0) ||
-			    (nas_disk_update(ts.tv_sec) != 0)) {
+		for (int i = 0; i < nfds; i++) {
+			if (events[i].data.fd == fb_fd) {
+				memset(&e, 0, sizeof(e));
+				if (read(fb_fd, &e, sizeof(e)) < 0) {
+					syslog(LOG_ERR, "read front board button failed");
+					break;
+				}
+				nas_front_panel_event(&e);
+			} else if (events[i].data.fd == pwr_fd) {
+				memset(&e, 0, sizeof(e));
+				if (read(pwr_fd, &e, sizeof(e)) < 0) {
+					syslog(LOG_ERR, "read power button failed");
+					break;
+				}
+				nas_power_event(&e);
+			} else if (events[i].data.fd == sts_fd) {
+				nas_stssrv_export();
+			} else if ((nas_psi_event(events[i].data.fd) == 0) ||
+				   (nas_raid_event(events[i].data.fd) == 0)) {
+				continue;
+			} else if (nas_sensor_alarm(events[i].data.fd) > 0) {
 				nas_power_off();
 				break;
 			}
+		}
 
-			nas_fan_update(nas_sensor_get_pwm(), nas_disk_get_pwm());
+		if ((keep_running == 0) || (nas_elapsed_ms(&tick_ts) < NAS_HW_SCAN_INTERVAL * 1000))
+			continue;
 
-			if (lcd_is_on()) {
-				if ((pwr_repeats != 0) &&
-				    (ts.tv_sec - pwr_ts > POWEROFF_EVENT_TIMEOUT)) {
-					pwr_repeats = 0;
-				}
+		clock_gettime(CLOCK_MONOTONIC, &tick_ts);
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
 
-				if ((pwr_repeats == 0) &&
-				    (ts.tv_sec - present_ts > PRESENT_TIMEOUT)) {
-					lcd_off();
-					info_major_index = LCD_INFO_SUMMARY;
-				}
+		if ((nas_sensor_update(ts.tv_sec) != 0) ||
+		    (nas_disk_update(ts.tv_sec) != 0) ||
+		    (nas_guard_update(ts.tv_sec) != 0)) {
+			nas_power_off();
+			break;
+		}
+
+		nas_fan_update();
+		nas_sysload_sample();
+		nas_psi_update();
+		nas_top_update(ts.tv_sec);
+		nas_raid_update();
+		cpu_freq_ladder(nas_sensor_cpu_margin(), nas_fan_headroom());
+
+		if (lcd_is_on()) {
+			if ((pwr_repeats != 0) &&
+			    (ts.tv_sec - pwr_ts > POWEROFF_EVENT_TIMEOUT)) {
+				pwr_repeats = 0;
 			}
-		} else {
-			for (int i = 0; i < nfds; i++) {
-				if (events[i].data.fd == fb_fd) {
-					memset(&e, 0, sizeof(e));
-					if (read(fb_fd, &e, sizeof(e)) < 0) {
-						syslog(LOG_ERR, "read front board button failed");
-						break;
-					}
-					nas_front_panel_event(&e);
-				} else if (events[i].data.fd == pwr_fd) {
-					memset(&e, 0, sizeof(e));
-					if (read(pwr_fd, &e, sizeof(e)) < 0) {
-						syslog(LOG_ERR, "read power button failed");
-						break;
-					}
-					nas_power_event(&e);
-				} else if (events[i].data.fd == sts_fd) {
-					nas_stssrv_export();
-				}
+
+			if ((pwr_repeats == 0) &&
+			    (ts.tv_sec - present_ts > PRESENT_TIMEOUT)) {
+				lcd_off();
+				info_major_index = LCD_INFO_SUMMARY;
 			}
 		}
 	}
@@ -7,7 +7,7 @@
 
 #include <time.h>
 
-#define TEMP_BUF_LEN 6
+#define LCD_LINE_CHARS  16
 
 #ifdef NAS_DEBUG
 #undef    LOG_EMERG
@@ -38,6 +38,13 @@ typedef enum {
 	NAS_CPU_FREQ_COUNT
 } nas_cpu_freq_spec;
 
+typedef enum {
+	NAS_CPU_CAP_FAN,
+	NAS_CPU_CAP_THERMAL,
+	NAS_CPU_CAP_LADDER,
+	NAS_CPU_CAP_REASONS
+} nas_cpu_cap_reason;
+
 const char *nas_get_model(void);
 const char *nas_get_filename(const char *path);
 void nas_create_pid_file(const char *name, pid_t pid);
@@ -47,6 +54,51 @@ void nas_log_error(void);
 int nas_read_file(const char *name, char *buf, int count);
 int nas_write_file(const char *name, const char *buf, int count);
 int nas_safe_write(const int fd, const char *buf, int count);
+int nas_pread_long(const int fd, long *value);
+int nas_pread_ulongs(const int fd, unsigned long *values, const int count);
+long nas_elapsed_ms(const struct timespec *since);
+
+/* main loop */
+void nas_event_watch(int fd);
+void nas_event_unwatch(int fd);
+
+/* config file */
+void nas_conf_load(const char *file);
+void nas_conf_load_optional(const char *file);
+int nas_conf_next(const char *name, const int prev);
+const char *nas_conf_get(const int sec, const char *key);
+double nas_conf_get_double(const int sec, const char *key, const double def);
+int nas_conf_get_bool(const int sec, const char *key, const int def);
+
+/* streaming statistics */
+#define NAS_STATS_WINDOW 5
+#define NAS_STATS_OUTLIER 0x1
+#define NAS_STATS_DRIFT   0x2
+
+struct nas_stats {
+	double ewma;
+	double baseline;
+	double mean;
+	double m2;
+	unsigned long n;
+	double window[NAS_STATS_WINDOW];
+	int pos;
+	int filled;
+	int rejected;
+	unsigned int outliers;
+	int drift;
+	double outlier_abs;
+	double outlier_rel;
+	double drift_abs;
+	double drift_rel;
+};
+
+void nas_stats_init(struct nas_stats *s, double outlier_abs, double outlier_rel, double drift_abs, double drift_rel);
+int nas_stats_add(struct nas_stats *s, double x);
+void nas_stats_restart(struct nas_stats *s);
+double nas_stats_median(const struct nas_stats *s);
+double nas_stats_stddev(const struct nas_stats *s);
+int nas_stats_to_json(const struct nas_stats *s, char *buf, size_t len);
 
 /* LCD */
 void lcd_open(void);
@@ -58,8 +110,24 @@ void lcd_close(void);
 int lcd_is_on(void);
 
 /* fan */
-void nas_fan_init(const char *dev);
-void nas_fan_update(int sensor, int disk);
+void nas_fan_init(const char *devs);
+void nas_fan_update(void);
+int nas_fan_to_json(char *buf, size_t len);
+int nas_fan_inputs(void);
+const char *nas_fan_input_name(int id);
+double nas_fan_input_temp(int id);
+void nas_fan_input_range(int id, double *low, double *high);
+void nas_fan_force(int pwm);
+void nas_fan_set_floor(int pwm);
+int nas_fan_headroom(void);
+
+/* predictive thermal guard */
+void nas_guard_init(void);
+int nas_guard_update(time_t now);
+int nas_guard_to_json(char *buf, size_t len);
+
+/* thermal model calibration */
+void nas_calibrate(const char *file, int step);
 
 /* sensor */
 extern double sys_temp_notice;
@@ -67,32 +135,108 @@ extern double cpu_temp_notice;
 extern double cpu_temp_halt;
 
 void nas_sensor_init(const char *conf);
+void nas_sensor_bench(int rounds);
 int nas_sensor_update(time_t now);
+int nas_sensor_update_all(void);
+int nas_sensor_alarm_fds(int *fds, int max);
+int nas_sensor_alarm(int fd);
 int nas_sensor_item_show(int off);
 void nas_sensor_summary_show(void);
 int nas_sensor_to_json(char *buf, size_t len);
-int nas_sensor_get_pwm(void);
+int nas_sensor_next_thermal(int prev);
+int nas_sensor_next_fan(int prev);
+int nas_sensor_find(const char *label);
+const char *nas_sensor_label(int id);
+double nas_sensor_value(int id);
+unsigned long nas_sensor_reads(int id);
+time_t nas_sensor_interval(int id);
+void nas_sensor_limits(int id, double *notice, double *halt);
+double nas_sensor_max(int id);
+double nas_sensor_cpu_margin(void);
 
 /* S.M.A.R.T */
 extern time_t smart_update_interval;
+extern time_t smart_hdd_update_interval;
 extern int hdd_temp_notice;
+extern int hdd_temp_warn;
 extern int hdd_temp_halt;
 extern int ssd_temp_notice;
+extern int ssd_temp_warn;
 extern int ssd_temp_halt;
+extern const char *disk_cache_file;
+extern int disk_probe_workers;
+extern const char *disk_spindown_list;
 
 void nas_disk_init(void);
 int nas_disk_update(time_t now);
 int nas_disk_item_show(int off);
 void nas_disk_summary_show(void);
 int nas_disk_to_json(char *buf, size_t len);
-int nas_disk_get_pwm(void);
+double nas_disk_get_temp(int ssd);
+double nas_disk_guard_temp(int ssd, unsigned long *gen, int *disks);
+int nas_disk_array_hot(int md);
+double nas_disk_match_temp(const char *pattern);
+
+/* SCSI log and VPD pages */
+const unsigned char *scsi_log_param(const unsigned char *page, int size, unsigned short code);
+int scsi_log_supported(const unsigned char *pages, int size, unsigned char page);
+int scsi_log_ie(const unsigned char *page, int size, unsigned char *ie, char *temp);
+int scsi_log_temperature(const unsigned char *page, int size, char *temp);
+unsigned short scsi_vpd_rotation_rate(const unsigned char *page, int size);
 
 /* system load and memory usage */
+void nas_sysload_init(void);
 void nas_sysload_update(void);
+void nas_sysload_sample(void);
 int nas_sysload_item_show(int off);
 void nas_sysload_summary_show(void);
 int nas_sysload_to_json(char *buf, size_t len);
 
+/* pressure stall information */
+enum {
+	NAS_PSI_CPU,
+	NAS_PSI_MEMORY,
+	NAS_PSI_IO,
+	NAS_PSI_RESOURCES
+};
+
+void nas_psi_init(void);
+int nas_psi_fds(int *fds, int max);
+int nas_psi_event(int fd);
+void nas_psi_update(void);
+double nas_psi_avg10(int res);
+unsigned long nas_psi_events(int res);
+int nas_psi_stalled(int res, time_t now, time_t seconds);
+int nas_psi_to_json(char *buf, size_t len);
+
+/* top resource consumers */
+#define NAS_TOP_COUNT 5
+
+enum {
+	NAS_TOP_CPU,
+	NAS_TOP_RSS,
+	NAS_TOP_IO,
+	NAS_TOP_KEYS
+};
+
+void nas_top_init(void);
+void nas_top_update(time_t now);
+const char *nas_top_first(int key, double *value);
+int nas_top_to_json(char *buf, size_t len);
+
+/* software RAID */
+void nas_raid_init(void);
+int nas_raid_fds(int *fds, int max);
+int nas_raid_event(int fd);
+void nas_raid_update(void);
+int nas_raid_has_member(int id, const char *dev);
+int nas_raid_member_of(const char *dev);
+unsigned long nas_raid_generation(void);
+const char *nas_raid_name(int id);
+int nas_raid_item_show(int off);
+void nas_raid_summary_show(void);
+int nas_raid_to_json(char *buf, size_t len);
+
 /* network interfaces */
 void nas_ifs_parse(const char *ifs);
 void nas_ifs_init(void);
@@ -102,6 +246,9 @@ int nas_ifs_to_json(char *buf, size_t len);
 
 void cpu_freq_init(void);
 int cpu_freq_select(int page_switch, int off);
+void cpu_freq_cap(nas_cpu_cap_reason reason, nas_cpu_freq_spec limit);
+void cpu_freq_ladder(double margin, int headroom);
+int cpu_freq_to_json(char *buf, size_t len);
 
 int nas_stssrv_init(short port);
 void nas_stssrv_export(void);
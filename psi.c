@@ -0,0 +1,201 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nasmon.h"
+
+/*
+ * Pressure stall information from /proc/pressure/{cpu,memory,io}. The
+ * averages are re-read on every tick through a file descriptor kept
+ * open; the same descriptor carries a kernel trigger ("some 150000
+ * 1000000": 150ms of stall in any 1s window) which the main loop sees
+ * as EPOLLPRI, so a stall is reported when it happens, without polling.
+ */
+
+static const time_t psi_log_interval = 60;
+
+enum {
+	NAS_PSI_SOME,
+	NAS_PSI_FULL,
+	NAS_PSI_LINES
+};
+
+static const char *const nas_psi_line_names[NAS_PSI_LINES] = {"some", "full"};
+
+struct nas_psi_avg {
+	double avg10;
+	double avg60;
+	double avg300;
+	unsigned long long total;   /* us */
+};
+
+struct nas_psi_resource {
+	const char *name;
+	const char *trigger;        /* default, [psi] <name> = ... overrides it */
+	int fd;
+	int triggered;              /* the trigger is registered */
+	struct nas_psi_avg avg[NAS_PSI_LINES];
+	unsigned long events;
+	time_t event_ts;
+	time_t log_ts;
+	unsigned long log_events;   /* events since the last log line */
+};
+
+static struct nas_psi_resource nas_psi[NAS_PSI_RESOURCES] = {
+	{"cpu",    "some 500000 1000000", -1},
+	{"memory", "some 150000 1000000", -1},
+	{"io",     "some 150000 1000000", -1}
+};
+
+static void nas_psi_free(void) {
+	for (int i = 0; i < NAS_PSI_RESOURCES; i++) {
+		if (nas_psi[i].fd >= 0)
+			nas_safe_close(nas_psi[i].fd);
+	}
+}
+
+static void nas_psi_read(struct nas_psi_resource *r) {
+	char buf[256];
+	ssize_t n;
+
+	if ((r->fd < 0) || ((n = pread(r->fd, buf, sizeof(buf) - 1, 0)) <= 0))
+		return;
+	buf[n] = '\0';
+
+	/* "some avg10=0.00 avg60=0.00 avg300=0.00 total=0", then the same for full */
+	for (char *p = buf; p != NULL; p = strchr(p, '\n')) {
+		if (*p == '\n')
+			p++;
+		for (int l = 0; l < NAS_PSI_LINES; l++) {
+			struct nas_psi_avg *a = r->avg + l;
+			size_t k = strlen(nas_psi_line_names[l]);
+
+			if ((strncmp(p, nas_psi_line_names[l], k) == 0) && (p[k] == ' ')) {
+				sscanf(p + k, " avg10=%lf avg60=%lf avg300=%lf total=%llu",
+				       &a->avg10, &a->avg60, &a->avg300, &a->total);
+				break;
+			}
+		}
+	}
+}
+
+void nas_psi_init(void) {
+	char path[64];
+	int sec = nas_conf_next("psi", -1);
+
+	atexit(nas_psi_free);
+
+	for (int i = 0; i < NAS_PSI_RESOURCES; i++) {
+		struct nas_psi_resource *r = nas_psi + i;
+		const char *trigger = nas_conf_get(sec, r->name);
+
+		if (trigger != NULL)
+			r->trigger = strcmp(trigger, "none") != 0 ? trigger : NULL;
+
+		snprintf(path, sizeof(path), "/proc/pressure/%s", r->name);
+		if ((r->fd = open(path, O_RDWR | O_NONBLOCK)) < 0)
+			r->fd = open(path, O_RDONLY);
+		if (r->fd < 0) {
+			syslog(LOG_INFO, "no pressure stall information for %s: %d", r->name, errno);
+			continue;
+		}
+
+		/* the trigger lives as long as the descriptor it was written to */
+		if (r->trigger != NULL) {
+			if (write(r->fd, r->trigger, strlen(r->trigger) + 1) < 0)
+				syslog(LOG_WARNING, "set pressure trigger \"%s\" on %s failed: %d", r->trigger, r->name,
+				       errno);
+			else {
+				r->triggered = 1;
+				syslog(LOG_INFO, "pressure trigger on %s: %s", r->name, r->trigger);
+			}
+		}
+		nas_psi_read(r);
+	}
+}
+
+/* descriptors with a trigger, to watch for EPOLLPRI */
+int nas_psi_fds(int *fds, const int max) {
+	int n = 0;
+
+	for (int i = 0; (i < NAS_PSI_RESOURCES) && (n < max); i++) {
+		if (nas_psi[i].triggered)
+			fds[n++] = nas_psi[i].fd;
+	}
+	return n;
+}
+
+/* 0 if fd is a pressure trigger and the event was handled, -1 if not ours */
+int nas_psi_event(const int fd) {
+	struct timespec ts;
+
+	for (int i = 0; i < NAS_PSI_RESOURCES; i++) {
+		struct nas_psi_resource *r = nas_psi + i;
+
+		if (!r->triggered || (r->fd != fd))
+			continue;
+
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+		r->events++;
+		r->log_events++;
+		r->event_ts = ts.tv_sec;
+		nas_psi_read(r);
+
+		/* a sustained stall fires once per window, log a line per interval */
+		if (ts.tv_sec - r->log_ts >= psi_log_interval) {
+			syslog(LOG_WARNING, "%s pressure stall (%s): %lu event(s), some avg10 %.2f%% avg60 %.2f%%",
+			       r->name, r->trigger, r->log_events, r->avg[NAS_PSI_SOME].avg10,
+			       r->avg[NAS_PSI_SOME].avg60);
+			r->log_ts = ts.tv_sec;
+			r->log_events = 0;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+void nas_psi_update(void) {
+	for (int i = 0; i < NAS_PSI_RESOURCES; i++)
+		nas_psi_read(nas_psi + i);
+}
+
+double nas_psi_avg10(const int res) {
+	return nas_psi[res].avg[NAS_PSI_SOME].avg10;
+}
+
+unsigned long nas_psi_events(const int res) {
+	return nas_psi[res].events;
+}
+
+/* the resource stalled within the last seconds */
+int nas_psi_stalled(const int res, const time_t now, const time_t seconds) {
+	return (nas_psi[res].events > 0) && (now - nas_psi[res].event_ts < seconds);
+}
+
+int nas_psi_to_json(char *buf, const size_t len) {
+	int count = 0;
+
+	for (int i = 0; i < NAS_PSI_RESOURCES; i++) {
+		const struct nas_psi_resource *r = nas_psi + i;
+
+		count += snprintf(buf + count, len - count, "%s\"%s\":{", i ? "," : "", r->name);
+		for (int l = 0; l < NAS_PSI_LINES; l++) {
+			const struct nas_psi_avg *a = r->avg + l;
+			count += snprintf(buf + count, len - count,
+					  "\"%s\":{\"avg10\":%.2f,\"avg60\":%.2f,\"avg300\":%.2f,\"total\":%llu},",
+					  nas_psi_line_names[l], a->avg10, a->avg60, a->avg300, a->total);
+		}
+		count += snprintf(buf + count, len - count, "\"trigger\":\"%s\",\"events\":%lu,\"last_event\":%ld}",
+				  r->triggered ? r->trigger : "", r->events, (long)r->event_ts);
+	}
+	return count;
+}
@@ -0,0 +1,643 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nasmon.h"
+
+/*
+ * Linux software RAID: the arrays and their members come from
+ * /proc/mdstat, the state from /sys/block/mdX/md/. Both are kept open,
+ * and md signals changes of /proc/mdstat (an array or member added,
+ * failed or removed, a resync started or finished) and of array_state,
+ * degraded, sync_action and sync_completed with sysfs_notify, seen by
+ * the main loop as EPOLLPRI. The progress of a resync is also re-read
+ * on every tick for its ETA.
+ *
+ * With a [raid_sync] section, a running check/resync is throttled
+ * through sync_speed_min/max: halved while there is foreground I/O
+ * through the array or I/O pressure, raised by half while idle, at the
+ * configured minimum while one of its disks is hot, and never below
+ * the pace that finishes it within the deadline, a hot check aside.
+ * md's own defaults come back when it finishes and at exit.
+ */
+
+#define NAS_RAID_MAX 16
+#define NAS_RAID_MEMBERS 32
+
+enum {
+	NAS_RAID_ATTR_STATE,
+	NAS_RAID_ATTR_DEGRADED,
+	NAS_RAID_ATTR_ACTION,
+	NAS_RAID_ATTR_COMPLETED,
+	NAS_RAID_ATTR_SPEED,
+	NAS_RAID_ATTRS
+};
+
+static const char *const nas_raid_attr_names[NAS_RAID_ATTRS] = {
+	"array_state", "degraded", "sync_action", "sync_completed", "sync_speed"
+};
+
+/* the attributes md calls sysfs_notify on */
+#define NAS_RAID_POLLABLE NAS_RAID_ATTR_SPEED
+
+static const time_t raid_sync_interval = 5;
+static const double raid_sync_hysteresis = 0.1;    /* a limit is rewritten when it moves more */
+
+static int raid_sync_enabled = 0;
+static long raid_sync_min = 1000;                   /* KiB/s */
+static long raid_sync_max = 200000;
+static double raid_sync_deadline = 24 * 3600;       /* s from the start of a check/resync */
+static double raid_sync_pressure = 10;              /* % io some avg10 */
+static double raid_sync_busy_iops = 50;             /* requests/s through the array */
+
+struct nas_raid_array {
+	char name[16];
+	char level[16];
+	char status[40];            /* "[6/5] [UUUUU_]" of mdstat */
+	int present;                /* still listed in /proc/mdstat */
+	int members;
+	char member[NAS_RAID_MEMBERS][32];
+	unsigned int failed;        /* bitmask of members marked (F) */
+	int fds[NAS_RAID_ATTRS];
+	char state[24];
+	long degraded;
+	char action[16];
+	unsigned long long done;    /* sectors */
+	unsigned long long total;
+	long speed;                 /* KiB/s */
+	long eta;                   /* seconds, -1 unknown */
+	int stat_fd;                /* /sys/block/mdX/stat, the I/O through the array, without the resync */
+	unsigned long ios;
+	double iops;
+	struct timespec sync_ts;
+	time_t sync_start;
+	long sync_min;              /* written limits, 0 while md's defaults apply */
+	long sync_max;
+	const char *throttle;       /* why the last step went where it did */
+};
+
+static int nas_raid_mdstat_fd = -1;
+static int nas_raid_count = 0;
+static unsigned long nas_raid_changes = 0;         /* arrays or members came or went */
+static struct nas_raid_array nas_raid[NAS_RAID_MAX];
+
+static void nas_raid_write_limit(const struct nas_raid_array *a, const char *attr, const char *value) {
+	char path[64];
+
+	snprintf(path, sizeof(path), "/sys/block/%s/md/%s", a->name, attr);
+	if (nas_write_file(path, value, (int)strlen(value)) < 0)
+		syslog(LOG_WARNING, "%s: write %s to %s failed: %d", a->name, value, attr, errno);
+}
+
+/* back to md's defaults of /proc/sys/dev/raid/speed_limit_* */
+static void nas_raid_unthrottle(struct nas_raid_array *a) {
+	/* a stopped array takes its limits along, it comes back with the defaults */
+	if ((a->sync_max > 0) && (a->fds[NAS_RAID_ATTR_STATE] >= 0)) {
+		nas_raid_write_limit(a, "sync_speed_min", "system");
+		nas_raid_write_limit(a, "sync_speed_max", "system");
+		syslog(LOG_INFO, "%s: sync speed limits back to the system defaults", a->name);
+	}
+	a->sync_min = 0;
+	a->sync_max = 0;
+	a->sync_start = 0;
+	a->throttle = NULL;
+	/* the next sync starts its I/O rate afresh, not over the time in between */
+	memset(&(a->sync_ts), 0, sizeof(a->sync_ts));
+	a->ios = 0;
+	a->iops = 0;
+}
+
+/* the main loop watches the pollable attributes once it runs, before that nas_raid_fds hands them over */
+static void nas_raid_open(struct nas_raid_array *a) {
+	char path[64];
+
+	for (int k = 0; k < NAS_RAID_ATTRS; k++) {
+		if (a->fds[k] >= 0)
+			continue;
+		snprintf(path, sizeof(path), "/sys/block/%s/md/%s", a->name, nas_raid_attr_names[k]);
+		a->fds[k] = open(path, O_RDONLY);
+		if ((k < NAS_RAID_POLLABLE) && (a->fds[k] >= 0))
+			nas_event_watch(a->fds[k]);
+	}
+	if (a->stat_fd < 0) {
+		snprintf(path, sizeof(path), "/sys/block/%s/stat", a->name);
+		a->stat_fd = open(path, O_RDONLY);
+	}
+}
+
+/*
+ * a stopped array: its attributes stay readable for poll with EPOLLERR
+ * and would wake the main loop for ever, drop them until it is back
+ */
+static void nas_raid_close(struct nas_raid_array *a) {
+	for (int k = 0; k < NAS_RAID_ATTRS; k++) {
+		if (a->fds[k] < 0)
+			continue;
+		if (k < NAS_RAID_POLLABLE)
+			nas_event_unwatch(a->fds[k]);
+		nas_safe_close(a->fds[k]);
+		a->fds[k] = -1;
+	}
+	if (a->stat_fd >= 0) {
+		nas_safe_close(a->stat_fd);
+		a->stat_fd = -1;
+	}
+}
+
+static void nas_raid_free(void) {
+	if (nas_raid_mdstat_fd >= 0)
+		nas_safe_close(nas_raid_mdstat_fd);
+
+	for (int i = 0; i < nas_raid_count; i++) {
+		nas_raid_unthrottle(nas_raid + i);
+		nas_raid_close(nas_raid + i);
+	}
+}
+
+/* one line of a sysfs attribute, without the newline; -1 if it can not be read */
+static int nas_raid_read_str(const int fd, char *buf, const size_t len) {
+	ssize_t n;
+
+	if ((fd < 0) || ((n = pread(fd, buf, len - 1, 0)) < 0)) {
+		buf[0] = '\0';
+		return -1;
+	}
+	while ((n > 0) && (buf[n - 1] == '\n'))
+		n--;
+	buf[n] = '\0';
+	return 0;
+}
+
+static struct nas_raid_array *nas_raid_add(const char *name) {
+	if (nas_raid_count >= NAS_RAID_MAX) {
+		syslog(LOG_WARNING, "too many md arrays, %s not monitored", name);
+		return NULL;
+	}
+
+	struct nas_raid_array *a = nas_raid + nas_raid_count++;
+	memset(a, 0, sizeof(*a));
+	snprintf(a->name, sizeof(a->name), "%s", name);
+	a->eta = -1;
+	for (int k = 0; k < NAS_RAID_ATTRS; k++)
+		a->fds[k] = -1;
+	a->stat_fd = -1;
+
+	nas_raid_open(a);
+	syslog(LOG_INFO, "watch md array %s", name);
+	return a;
+}
+
+static struct nas_raid_array *nas_raid_find(const char *name) {
+	for (int i = 0; i < nas_raid_count; i++) {
+		if (strcmp(nas_raid[i].name, name) == 0)
+			return nas_raid + i;
+	}
+	return NULL;
+}
+
+/*
+ * md0 : active raid6 sdf1[5] sde1[4](F) sdd1[3]
+ *       11720294400 blocks super 1.2 level 6, 512k chunk, algorithm 2 [6/5] [UUUU_U]
+ */
+static void nas_raid_parse_mdstat(void) {
+	char buf[16384];
+	ssize_t n;
+
+	if ((nas_raid_mdstat_fd < 0) || ((n = pread(nas_raid_mdstat_fd, buf, sizeof(buf) - 1, 0)) < 0))
+		return;
+	buf[n] = '\0';
+
+	int present[NAS_RAID_MAX];
+	for (int i = 0; i < nas_raid_count; i++) {
+		present[i] = nas_raid[i].present;
+		nas_raid[i].present = 0;
+	}
+	int count = nas_raid_count;
+
+	struct nas_raid_array *a = NULL;
+	char *save = NULL;
+	for (char *line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+		char *sep = strstr(line, " : ");
+
+		if ((strncmp(line, "md", 2) == 0) && (sep != NULL)) {
+			*sep = '\0';
+			if ((a = nas_raid_find(line)) != NULL) {
+				if (a->fds[NAS_RAID_ATTR_STATE] < 0) {
+					nas_raid_open(a);
+					if (a->fds[NAS_RAID_ATTR_STATE] >= 0)
+						syslog(LOG_INFO, "watch md array %s again", a->name);
+				}
+			} else if ((a = nas_raid_add(line)) == NULL)
+				continue;
+
+			int members = a->members;
+			a->present = 1;
+			a->members = 0;
+			a->failed = 0;
+			a->level[0] = '\0';
+			a->status[0] = '\0';
+
+			char *tok_save = NULL;
+			for (char *tok = strtok_r(sep + 3, " ", &tok_save); tok != NULL; tok = strtok_r(NULL, " ", &tok_save)) {
+				char *idx = strchr(tok, '[');
+
+				if (idx == NULL) {
+					/* active/inactive, (read-only) and the level */
+					if ((strncmp(tok, "raid", 4) == 0) || (strcmp(tok, "linear") == 0))
+						snprintf(a->level, sizeof(a->level), "%s", tok);
+					continue;
+				}
+				if (a->members >= NAS_RAID_MEMBERS)
+					continue;
+				if (strstr(idx, "(F)") != NULL)
+					a->failed |= 1u << a->members;
+				*idx = '\0';
+				if ((a->members >= members) || (strcmp(a->member[a->members], tok) != 0))
+					nas_raid_changes++;
+				snprintf(a->member[a->members++], sizeof(a->member[0]), "%s", tok);
+			}
+			if (a->members != members)
+				nas_raid_changes++;
+		} else if ((a != NULL) && (line[0] == ' ') && (a->status[0] == '\0')) {
+			/* the [n/m] [UU_] of the first detail line */
+			char *st = strstr(line, "] [");
+			while ((st != NULL) && (st > line) && (*st != ' '))
+				st--;
+			if (st != NULL)
+				snprintf(a->status, sizeof(a->status), "%s", st + 1);
+		} else if (line[0] != ' ')
+			a = NULL;
+	}
+
+	for (int i = 0; i < nas_raid_count; i++) {
+		if ((i >= count) || (nas_raid[i].present != present[i]))
+			nas_raid_changes++;
+	}
+}
+
+/* the newly read state against the old one, worth a log line */
+static void nas_raid_read(struct nas_raid_array *a) {
+	char buf[64];
+	char action[sizeof(a->action)];
+	long degraded = 0;
+
+	/* the attributes of a stopped array fail to read, or it left /proc/mdstat */
+	if ((nas_raid_read_str(a->fds[NAS_RAID_ATTR_STATE], a->state, sizeof(a->state)) < 0) || !a->present) {
+		if (a->fds[NAS_RAID_ATTR_STATE] >= 0) {
+			syslog(LOG_NOTICE, "%s: array stopped", a->name);
+			nas_raid_close(a);
+		}
+		snprintf(a->state, sizeof(a->state), "%s", a->present ? "unknown" : "gone");
+	}
+
+	/* stopped, not repaired: keep the last degraded, action and progress */
+	if (a->fds[NAS_RAID_ATTR_STATE] < 0) {
+		a->speed = 0;
+		a->eta = -1;
+		return;
+	}
+
+	if ((a->fds[NAS_RAID_ATTR_DEGRADED] >= 0) && (nas_pread_long(a->fds[NAS_RAID_ATTR_DEGRADED], &degraded) < 0))
+		degraded = 0;
+	if (degraded != a->degraded) {
+		if (degraded > 0)
+			syslog(LOG_ALERT, "%s: array degraded, %ld member(s) missing %s", a->name, degraded, a->status);
+		else
+			syslog(LOG_NOTICE, "%s: array no longer degraded", a->name);
+		a->degraded = degraded;
+	}
+
+	nas_raid_read_str(a->fds[NAS_RAID_ATTR_ACTION], action, sizeof(action));
+	if (strcmp(action, a->action) != 0) {
+		if ((strcmp(action, "idle") != 0) && (action[0] != '\0'))
+			syslog(LOG_NOTICE, "%s: %s started", a->name, action);
+		else if ((strcmp(a->action, "idle") != 0) && (a->action[0] != '\0'))
+			syslog(LOG_NOTICE, "%s: %s finished", a->name, a->action);
+		memcpy(a->action, action, sizeof(action));
+	}
+
+	/* "done / total" in sectors, or "none" */
+	a->done = 0;
+	a->total = 0;
+	if (nas_raid_read_str(a->fds[NAS_RAID_ATTR_COMPLETED], buf, sizeof(buf)) == 0)
+		sscanf(buf, "%llu / %llu", &(a->done), &(a->total));
+
+	a->speed = 0;
+	if (nas_raid_read_str(a->fds[NAS_RAID_ATTR_SPEED], buf, sizeof(buf)) == 0)
+		a->speed = strtol(buf, NULL, 10);
+
+	a->eta = -1;
+	if ((a->total > a->done) && (a->speed > 0))
+		a->eta = (long)((a->total - a->done) / 2 / (unsigned long long)a->speed);
+}
+
+void nas_raid_init(void) {
+	int sec = nas_conf_next("raid_sync", -1);
+
+	atexit(nas_raid_free);
+
+	if (sec >= 0) {
+		raid_sync_enabled = nas_conf_get_bool(sec, "enable", 1);
+		raid_sync_min = (long)nas_conf_get_double(sec, "min", (double)raid_sync_min);
+		raid_sync_max = (long)nas_conf_get_double(sec, "max", (double)raid_sync_max);
+		raid_sync_deadline = nas_conf_get_double(sec, "deadline", raid_sync_deadline / 3600) * 3600;
+		raid_sync_pressure = nas_conf_get_double(sec, "io_pressure", raid_sync_pressure);
+		raid_sync_busy_iops = nas_conf_get_double(sec, "busy_iops", raid_sync_busy_iops);
+		if (raid_sync_max < raid_sync_min)
+			raid_sync_max = raid_sync_min;
+		if (raid_sync_enabled)
+			syslog(LOG_INFO, "throttle md sync between %ld and %ld KiB/s, deadline %.0fh", raid_sync_min,
+			       raid_sync_max, raid_sync_deadline / 3600);
+	}
+
+	if ((nas_raid_mdstat_fd = open("/proc/mdstat", O_RDONLY)) < 0) {
+		syslog(LOG_INFO, "no software RAID: %d", errno);
+		return;
+	}
+
+	nas_raid_parse_mdstat();
+	for (int i = 0; i < nas_raid_count; i++) {
+		nas_raid_read(nas_raid + i);
+		syslog(LOG_INFO, "%s: %s %s %s, %d member(s)", nas_raid[i].name, nas_raid[i].level, nas_raid[i].state,
+		       nas_raid[i].status, nas_raid[i].members);
+	}
+}
+
+/* /proc/mdstat and the pollable attributes of the arrays, to watch for EPOLLPRI */
+int nas_raid_fds(int *fds, const int max) {
+	int n = 0;
+
+	if ((nas_raid_mdstat_fd >= 0) && (n < max))
+		fds[n++] = nas_raid_mdstat_fd;
+
+	for (int i = 0; i < nas_raid_count; i++) {
+		for (int k = 0; k < NAS_RAID_POLLABLE; k++) {
+			if ((nas_raid[i].fds[k] >= 0) && (n < max))
+				fds[n++] = nas_raid[i].fds[k];
+		}
+	}
+	return n;
+}
+
+/* 0 if fd belongs to an array and was handled, -1 if not ours */
+int nas_raid_event(const int fd) {
+	if (fd < 0)
+		return -1;
+
+	if (fd == nas_raid_mdstat_fd) {
+		nas_raid_update();
+		return 0;
+	}
+
+	for (int i = 0; i < nas_raid_count; i++) {
+		for (int k = 0; k < NAS_RAID_POLLABLE; k++) {
+			if (nas_raid[i].fds[k] == fd) {
+				nas_raid_read(nas_raid + i);
+				return 0;
+			}
+		}
+	}
+	return -1;
+}
+
+static int nas_raid_busy(const struct nas_raid_array *a) {
+	return (a->action[0] != '\0') && (strcmp(a->action, "idle") != 0) && (a->total > 0);
+}
+
+static int nas_raid_moved(const long from, const long to) {
+	return (from == 0) || (labs(to - from) > (long)(raid_sync_hysteresis * (double)from));
+}
+
+static void nas_raid_throttle(struct nas_raid_array *a) {
+	struct timespec ts;
+	unsigned long stat[5];
+
+	if (!raid_sync_enabled)
+		return;
+	if (!nas_raid_busy(a) || (a->fds[NAS_RAID_ATTR_STATE] < 0)) {
+		if (a->sync_max > 0)
+			nas_raid_unthrottle(a);
+		return;
+	}
+
+	/* events re-read the array as well, step on the tick only */
+	if ((a->sync_ts.tv_sec != 0) && (nas_elapsed_ms(&(a->sync_ts)) < raid_sync_interval * 1000))
+		return;
+	double dt = a->sync_ts.tv_sec != 0 ? nas_elapsed_ms(&(a->sync_ts)) / 1000.0 : 0;
+	clock_gettime(CLOCK_MONOTONIC, &(a->sync_ts));
+
+	if ((a->stat_fd >= 0) && (nas_pread_ulongs(a->stat_fd, stat, 5) == 5)) {
+		unsigned long ios = stat[0] + stat[4];
+		a->iops = (dt > 0) && (a->ios != 0) ? (double)(ios - a->ios) / dt : 0;
+		a->ios = ios;
+	}
+
+	/* a sync already running when first seen: as if it had kept its current speed so far */
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	if (a->sync_start == 0) {
+		double ran = a->speed > 0 ? (double)a->done / 2 / (double)a->speed : 0;
+		a->sync_start = ts.tv_sec - (time_t)(ran < raid_sync_deadline ? ran : raid_sync_deadline);
+	}
+
+	/* the pace that still finishes within the deadline */
+	double left = raid_sync_deadline - (double)(ts.tv_sec - a->sync_start);
+	long need = left > 0 ? (long)((double)(a->total - a->done) / 2 / left) : raid_sync_max;
+	if (need < raid_sync_min)
+		need = raid_sync_min;
+	if (need > raid_sync_max)
+		need = raid_sync_max;
+
+	long max = a->sync_max > 0 ? a->sync_max : need;
+	if (nas_disk_array_hot((int)(a - nas_raid))) {
+		/* heat wins over the deadline of a check, a recovery still restores redundancy in time */
+		max = raid_sync_min;
+		if ((strcmp(a->action, "check") == 0) || (strcmp(a->action, "repair") == 0))
+			need = raid_sync_min;
+		a->throttle = "hot";
+	} else if ((nas_psi_avg10(NAS_PSI_IO) >= raid_sync_pressure) || (a->iops >= raid_sync_busy_iops)) {
+		max /= 2;
+		a->throttle = "busy";
+	} else {
+		max += max / 2;
+		a->throttle = "idle";
+	}
+	if (max < need) {
+		max = need;
+		a->throttle = "deadline";
+	}
+	if (max > raid_sync_max)
+		max = raid_sync_max;
+	if (max < raid_sync_min)
+		max = raid_sync_min;
+
+	/* md keeps to min even with foreground I/O, that is the deadline pace */
+	long min = need < max ? need : max;
+
+	if (nas_raid_moved(a->sync_min, min) || nas_raid_moved(a->sync_max, max)) {
+		char min_value[24], max_value[24];
+
+		snprintf(min_value, sizeof(min_value), "%ld", min);
+		snprintf(max_value, sizeof(max_value), "%ld", max);
+		/* min stays below max in between: a falling min goes first, else max */
+		if (min < a->sync_min) {
+			nas_raid_write_limit(a, "sync_speed_min", min_value);
+			nas_raid_write_limit(a, "sync_speed_max", max_value);
+		} else {
+			nas_raid_write_limit(a, "sync_speed_max", max_value);
+			nas_raid_write_limit(a, "sync_speed_min", min_value);
+		}
+#ifndef NDEBUG
+		syslog(LOG_DEBUG, "%s: %s sync %ld..%ld KiB/s (%s)", a->name, a->action, min, max, a->throttle);
+#endif
+		a->sync_min = min;
+		a->sync_max = max;
+	}
+}
+
+void nas_raid_update(void) {
+	if (nas_raid_mdstat_fd < 0)
+		return;
+
+	nas_raid_parse_mdstat();
+	for (int i = 0; i < nas_raid_count; i++) {
+		nas_raid_read(nas_raid + i);
+		nas_raid_throttle(nas_raid + i);
+	}
+}
+
+/* 1 if a partition or the whole of dev is a member of the array */
+int nas_raid_has_member(const int id, const char *dev) {
+	size_t len = strlen(dev);
+
+	for (int m = 0; m < nas_raid[id].members; m++) {
+		const char *p = nas_raid[id].member[m];
+
+		/* sda, sda1, nvme0n1p1 are dev sda/nvme0n1, sdaa1 is not */
+		if ((strncmp(p, dev, len) == 0) &&
+		    ((p[len] == '\0') || ((p[len] >= '0') && (p[len] <= '9')) ||
+		     ((p[len] == 'p') && (p[len + 1] >= '0') && (p[len + 1] <= '9'))))
+			return 1;
+	}
+	return 0;
+}
+
+/* index of the first running array with a partition or the whole of dev as member, -1 if none */
+int nas_raid_member_of(const char *dev) {
+	for (int i = 0; i < nas_raid_count; i++) {
+		if (nas_raid[i].present && nas_raid_has_member(i, dev))
+			return i;
+	}
+	return -1;
+}
+
+/* changes whenever an array or a member comes or goes, to regroup the disk peers */
+unsigned long nas_raid_generation(void) {
+	return nas_raid_changes;
+}
+
+const char *nas_raid_name(const int id) {
+	return nas_raid[id].name;
+}
+
+static const char *nas_raid_eta_fmt(char *buf, const size_t len, const long eta) {
+	if (eta < 0)
+		snprintf(buf, len, "?");
+	else if (eta >= 3600)
+		snprintf(buf, len, "%ldh%02ldm", eta / 3600, eta / 60 % 60);
+	else
+		snprintf(buf, len, "%ldm", (eta + 59) / 60);
+	return buf;
+}
+
+static void nas_raid_show(const struct nas_raid_array *a, const int line) {
+	char eta[24];
+
+	if (nas_raid_busy(a))
+		lcd_printf(line, "%s %.1f%% %s", a->action, (double)a->done * 100 / (double)a->total,
+			   nas_raid_eta_fmt(eta, sizeof(eta), a->eta));
+	else
+		lcd_printf(line, "%s", a->status[0] != '\0' ? a->status : a->state);
+}
+
+int nas_raid_item_show(const int off) {
+	static int id = -1;
+
+	if (nas_raid_count == 0) {
+		lcd_printf(1, "RAID:");
+		lcd_printf(2, "N/A");
+		return id;
+	}
+
+	id = id >= 0 ? (nas_raid_count + id + off) % nas_raid_count : 0;
+
+	const struct nas_raid_array *a = nas_raid + id;
+	if (a->degraded > 0)
+		lcd_printf(1, "%s %s DEGR-%ld", a->name, a->level, a->degraded);
+	else
+		lcd_printf(1, "%s %s %s", a->name, a->level, a->state);
+	nas_raid_show(a, 2);
+
+	return id;
+}
+
+void nas_raid_summary_show(void) {
+	const struct nas_raid_array *show = NULL;
+	int ok = 0;
+
+	/* a degraded array first, then one in resync */
+	for (int i = 0; i < nas_raid_count; i++) {
+		const struct nas_raid_array *a = nas_raid + i;
+
+		if (a->degraded == 0)
+			ok++;
+		if ((a->degraded > 0) && ((show == NULL) || (show->degraded == 0)))
+			show = a;
+		else if ((show == NULL) && nas_raid_busy(a))
+			show = a;
+	}
+
+	lcd_printf(1, "RAID: %d/%d ok", ok, nas_raid_count);
+	if (show == NULL)
+		lcd_printf(2, nas_raid_count > 0 ? "all idle" : "N/A");
+	else if (show->degraded > 0)
+		lcd_printf(2, "%s DEGRADED", show->name);
+	else
+		nas_raid_show(show, 2);
+}
+
+int nas_raid_to_json(char *buf, const size_t len) {
+	int count = 0;
+
+	for (int i = 0; i < nas_raid_count; i++) {
+		const struct nas_raid_array *a = nas_raid + i;
+
+		count += snprintf(buf + count, len - count,
+				  "%s\"%s\":{\"Level\":\"%s\",\"State\":\"%s\",\"Degraded\":%ld,\"Status\":\"%s\",\"Members\":[",
+				  i ? "," : "", a->name, a->level, a->state, a->degraded, a->status);
+		for (int m = 0; m < a->members; m++)
+			count += snprintf(buf + count, len - count, "%s{\"Name\":\"%s\",\"Failed\":%s}", m ? "," : "",
+					  a->member[m], (a->failed & (1u << m)) ? "true" : "false");
+		count += snprintf(buf + count, len - count,
+				  "],\"SyncAction\":\"%s\",\"SyncDone\":%llu,\"SyncTotal\":%llu,\"SyncSpeed\":%ld,\"ETA\":",
+				  a->action, a->done * 512, a->total * 512, a->speed * 1024);
+		if (a->eta < 0)
+			count += snprintf(buf + count, len - count, "null");
+		else
+			count += snprintf(buf + count, len - count, "%ld", a->eta);
+		if (a->sync_max > 0)
+			count += snprintf(buf + count, len - count,
+					  ",\"Throttle\":{\"Reason\":\"%s\",\"SpeedMin\":%ld,\"SpeedMax\":%ld,\"IOPS\":%.1f}",
+					  a->throttle, a->sync_min * 1024, a->sync_max * 1024, a->iops);
+		buf[count++] = '}';
+	}
+	return count;
+}
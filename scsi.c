@@ -0,0 +1,85 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <sys/types.h>
+#include <string.h>
+
+#include "nasmon.h"
+
+/*
+ * Parsers of the SCSI log and VPD pages read by smart.c. They only look
+ * at the bytes the drive returned: a page length or a parameter length
+ * running past the buffer is cut at its end, never read beyond it.
+ */
+
+#define LOG_PAGE_TEMP_INVALID   0xFF
+
+/* the parameter with the given code in a log page, NULL if absent or cut short */
+const unsigned char *scsi_log_param(const unsigned char *page, const int size, const unsigned short code) {
+	if (size < 4)
+		return NULL;
+
+	int len = ((page[2] << 8) | page[3]) + 4;
+	const unsigned char *end = page + (len < size ? len : size);
+	const unsigned char *p = page + 4;
+
+	while (p + 4 <= end) {
+		if ((p + 4 + p[3]) > end)
+			break;
+		if (((p[0] << 8) | p[1]) == code)
+			return p;
+		p += 4 + p[3];
+	}
+
+	return NULL;
+}
+
+/* 1 if the supported log pages page (0x00) lists the page */
+int scsi_log_supported(const unsigned char *pages, const int size, const unsigned char page) {
+	if (size < 4)
+		return 0;
+
+	int len = ((pages[2] << 8) | pages[3]) + 4;
+	for (int i = 4; (i < len) && (i < size); i++) {
+		if (pages[i] == page)
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * informational exceptions page (0x2F): ASC and ASCQ of the most recent
+ * exception, and the temperature reported with it, 0 if invalid.
+ * -1 if the page has no general parameter.
+ */
+int scsi_log_ie(const unsigned char *page, const int size, unsigned char *ie, char *temp) {
+	const unsigned char *param = scsi_log_param(page, size, 0);
+
+	if ((param == NULL) || (param[3] < 2))
+		return -1;
+
+	ie[0] = param[4];
+	ie[1] = param[5];
+	*temp = (param[3] >= 3) && (param[6] != LOG_PAGE_TEMP_INVALID) ? (char)param[6] : 0;
+	return 0;
+}
+
+/* temperature page (0x0D): the current temperature, -1 if absent or invalid */
+int scsi_log_temperature(const unsigned char *page, const int size, char *temp) {
+	const unsigned char *param = scsi_log_param(page, size, 0);
+
+	if ((param == NULL) || (param[3] < 2) || (param[5] == LOG_PAGE_TEMP_INVALID))
+		return -1;
+
+	*temp = (char)param[5];
+	return 0;
+}
+
+/* block device characteristics VPD page (0xB1): the nominal rotation rate, 0 if not reported */
+unsigned short scsi_vpd_rotation_rate(const unsigned char *page, const int size) {
+	if ((size < 6) || (((page[2] << 8) | page[3]) < 2))
+		return 0;
+
+	return (page[4] << 8) | page[5];
+}
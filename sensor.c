@@ -2,147 +2,462 @@
  * Created by benstone on 2019/10/6.
  */
 
+#include <sys/types.h>
+#include <dirent.h>
 #include <syslog.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <errno.h>
+#include <math.h>
+#include <time.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifndef NAS_NO_LIBSENSORS
 #include <sensors/sensors.h>
+#endif
 
 #include "nasmon.h"
 
 static const time_t update_interval = 60;
+/* sensors with a pollable *_alarm raise their own events, they are polled less often */
+static const time_t alarm_update_interval = 300;
 
-/* sensors */
-enum nas_sensors_ids {
-	NAS_SENSOR_CPU,
-	NAS_SENSOR_System,
-	NAS_SENSOR_Fan,
-	NAS_SENSOR_Vcore,
-	NAS_SENSOR_V1_2,
-	NAS_SENSOR_V3_3,
-	NAS_SENSOR_V5_0,
-	NAS_SENSOR_V12,
-	NAS_SENSORS_COUNT
+enum nas_sensor_roles {
+	NAS_SENSOR_ROLE_CPU,
+	NAS_SENSOR_ROLE_BOARD,
+	NAS_SENSOR_ROLE_FAN,
+	NAS_SENSOR_ROLE_RAIL,
+	NAS_SENSOR_ROLES
 };
-#define NAS_SENSOR_MIN NAS_SENSOR_CPU
 
-struct nas_sensors_info {
-	const sensors_feature_type feature_type;
-	const sensors_subfeature_type subfeature_input;
-	const sensors_subfeature_type subfeature_min;
-	const sensors_subfeature_type subfeature_max;
+static const char *nas_sensor_role_names[NAS_SENSOR_ROLES] = {
+	"cpu",
+	"board",
+	"fan",
+	"rail",
+};
+
+#ifndef NAS_NO_LIBSENSORS
+#define NAS_SENSOR_SUBFEATURES(t, i, l, h) \
+	.feature_type = t, .subfeature_input = i, .subfeature_min = l, .subfeature_max = h
+#else
+#define NAS_SENSOR_SUBFEATURES(t, i, l, h)
+#endif
+
+struct nas_sensor_type {
+	const char *name;   /* also the prefix of hwmon sysfs attributes */
+	const char *fmt;
+	double unit;        /* sysfs integer to the displayed unit */
+	double outlier_abs; /* outlier and drift limits, absolute + relative to the level */
+	double outlier_rel;
+	double drift_abs;
+	double drift_rel;
+#ifndef NAS_NO_LIBSENSORS
+	sensors_feature_type feature_type;
+	sensors_subfeature_type subfeature_input;
+	sensors_subfeature_type subfeature_min;
+	sensors_subfeature_type subfeature_max;
+#endif
+};
+
+static const struct nas_sensor_type nas_sensor_types[] = {
+	{"temp",  "%.1f C",   1e-3, 5, 0,    8, 0, NAS_SENSOR_SUBFEATURES(SENSORS_FEATURE_TEMP, SENSORS_SUBFEATURE_TEMP_INPUT,
+							   SENSORS_SUBFEATURE_TEMP_MIN, SENSORS_SUBFEATURE_TEMP_MAX)},
+	{"fan",   "%.0f RPM", 1,    200, 0.2, 0, 0.15, NAS_SENSOR_SUBFEATURES(SENSORS_FEATURE_FAN, SENSORS_SUBFEATURE_FAN_INPUT,
+							   SENSORS_SUBFEATURE_FAN_MIN, SENSORS_SUBFEATURE_FAN_MAX)},
+	{"in",    "%.6f V",   1e-3, 0, 0.05,  0, 0.02, NAS_SENSOR_SUBFEATURES(SENSORS_FEATURE_IN, SENSORS_SUBFEATURE_IN_INPUT,
+							   SENSORS_SUBFEATURE_IN_MIN, SENSORS_SUBFEATURE_IN_MAX)},
+	{"curr",  "%.3f A",   1e-3, 0, 0.2,   0, 0.2, NAS_SENSOR_SUBFEATURES(SENSORS_FEATURE_CURR, SENSORS_SUBFEATURE_CURR_INPUT,
+							   SENSORS_SUBFEATURE_CURR_MIN, SENSORS_SUBFEATURE_CURR_MAX)},
+	{"power", "%.1f W",   1e-6, 0, 0.2,   0, 0.2, NAS_SENSOR_SUBFEATURES(SENSORS_FEATURE_POWER, SENSORS_SUBFEATURE_POWER_INPUT,
+							   SENSORS_SUBFEATURE_UNKNOWN, SENSORS_SUBFEATURE_UNKNOWN)},
+};
+#define NAS_SENSOR_TYPES (sizeof(nas_sensor_types) / sizeof(nas_sensor_types[0]))
+
+/* built-in table of RN626X, used when the config has no [sensor] section */
+static const struct {
 	const char *label;
+	const char *type;
+	const char *title;
+	unsigned char role;
+	unsigned char summary;
+} nas_sensor_defaults[] = {
+	{"CPU",    "temp", "CPU Temp:",     NAS_SENSOR_ROLE_CPU,   1},
+	{"System", "temp", "System Temp:",  NAS_SENSOR_ROLE_BOARD, 1},
+	{"Fan",    "fan",  "System Fan:",   NAS_SENSOR_ROLE_FAN,   1},
+	{"Vcore",  "in",   "Voltage Core:", NAS_SENSOR_ROLE_RAIL,  1},
+	{"V1_2",   "in",   "Voltage V1.2:", NAS_SENSOR_ROLE_RAIL,  0},
+	{"V3_3",   "in",   "Voltage V3.3:", NAS_SENSOR_ROLE_RAIL,  0},
+	{"V5_0",   "in",   "Voltage V5.0:", NAS_SENSOR_ROLE_RAIL,  1},
+	{"V+12",   "in",   "Voltage V+12:", NAS_SENSOR_ROLE_RAIL,  1},
+};
+#define NAS_SENSOR_DEFAULTS (sizeof(nas_sensor_defaults) / sizeof(nas_sensor_defaults[0]))
+
+struct nas_sensors_info {
+#ifndef NAS_NO_LIBSENSORS
 	const sensors_chip_name *chip;
-	const sensors_feature *feature;
 	int nr;
+#endif
+	const struct nas_sensor_type *type;
+	char *path;         /* hwmon sysfs directory */
+	int fd;             /* persistent <attr>_input, -1 to use libsensors */
+	int alarm_fd;       /* <attr>_alarm, in the main epoll set */
+	double scale;       /* compute expression folded to value = raw * scale + offset */
+	double offset;
+	unsigned char role;
+	unsigned char summary;
 	double value;
 	double min;
 	double max;
+	double notice;
+	double halt;
+	char label[32];
+	char title[LCD_LINE_CHARS + 1];
+	char chip_pattern[32];
+	char attr[16];
+	struct nas_stats stats;
+	unsigned long reads;    /* readings taken, a new one for the thermal guard when it changes */
 };
 
-static struct nas_sensors_info nas_sensors[NAS_SENSORS_COUNT] = {
-	{
-		.feature_type = SENSORS_FEATURE_TEMP,
-		.subfeature_input = SENSORS_SUBFEATURE_TEMP_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_TEMP_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_TEMP_MAX,
-		.label = "CPU",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_TEMP,
-		.subfeature_input = SENSORS_SUBFEATURE_TEMP_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_TEMP_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_TEMP_MAX,
-		.label = "System",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_FAN,
-		.subfeature_input = SENSORS_SUBFEATURE_FAN_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_FAN_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_FAN_MAX,
-		.label = "Fan",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_IN,
-		.subfeature_input = SENSORS_SUBFEATURE_IN_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_IN_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_IN_MAX,
-		.label = "Vcore",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_IN,
-		.subfeature_input = SENSORS_SUBFEATURE_IN_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_IN_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_IN_MAX,
-		.label = "V1_2",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_IN,
-		.subfeature_input = SENSORS_SUBFEATURE_IN_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_IN_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_IN_MAX,
-		.label = "V3_3",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_IN,
-		.subfeature_input = SENSORS_SUBFEATURE_IN_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_IN_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_IN_MAX,
-		.label = "V5_0",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-	{
-		.feature_type = SENSORS_FEATURE_IN,
-		.subfeature_input = SENSORS_SUBFEATURE_IN_INPUT,
-		.subfeature_min = SENSORS_SUBFEATURE_IN_MIN,
-		.subfeature_max = SENSORS_SUBFEATURE_IN_MAX,
-		.label = "V+12",
-		.chip = NULL,
-		.feature = NULL,
-		.nr = -1,
-	},
-};
+static int nas_sensors_count = 0;
+static struct nas_sensors_info *nas_sensors = NULL;
 
 double sys_temp_notice = 40.0;
 double cpu_temp_notice = 40.0;
 double cpu_temp_halt = 70.0;
 
-static double temp_buf[TEMP_BUF_LEN];
+void nas_sensor_free(void) {
+#ifndef NAS_NO_LIBSENSORS
+	sensors_cleanup();
+#endif
+	for (int i = 0; i < nas_sensors_count; i++) {
+		if (nas_sensors[i].fd >= 0)
+			nas_safe_close(nas_sensors[i].fd);
+		if (nas_sensors[i].alarm_fd >= 0)
+			nas_safe_close(nas_sensors[i].alarm_fd);
+		free(nas_sensors[i].path);
+	}
+	free(nas_sensors);
+}
 
-void nas_sensor_temp_init(double *buf, const double t) {
-	for (int i = 0; i < TEMP_BUF_LEN; i++)
-		buf[i] = t;
+static const struct nas_sensor_type *nas_sensor_find_type(const char *name) {
+	for (int i = 0; i < NAS_SENSOR_TYPES; i++) {
+		if (strcmp(nas_sensor_types[i].name, name) == 0)
+			return nas_sensor_types + i;
+	}
+	return NULL;
 }
 
-void nas_sensor_free(void) {
-	sensors_cleanup();
+static int nas_sensor_find_role(const char *name) {
+	for (int i = 0; i < NAS_SENSOR_ROLES; i++) {
+		if (strcmp(nas_sensor_role_names[i], name) == 0)
+			return i;
+	}
+	return -1;
 }
 
-void nas_sensor_init(const char *conf) {
-	nas_sensor_temp_init(temp_buf, -1);
+static void nas_sensor_set_defaults(struct nas_sensors_info *p) {
+#ifndef NAS_NO_LIBSENSORS
+	p->nr = -1;
+#endif
+	p->fd = -1;
+	p->alarm_fd = -1;
+	p->scale = NAN;
+	p->offset = 0;
+	p->min = NAN;
+	p->max = NAN;
+	p->notice = NAN;
+	p->halt = NAN;
+}
+
+/*
+ * one [sensor] section per sensor: label, type, role, title, chip, attr,
+ * scale, offset, min, max, notice, halt, summary
+ */
+static void nas_sensor_load_conf(void) {
+	int count = 0;
+	for (int sec = nas_conf_next("sensor", -1); sec >= 0; sec = nas_conf_next("sensor", sec))
+		count++;
+
+	if ((nas_sensors = calloc(sizeof(*nas_sensors), count ? count : NAS_SENSOR_DEFAULTS)) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for sensors");
+		exit(EXIT_FAILURE);
+	}
+
+	if (count == 0) {
+		for (int i = 0; i < NAS_SENSOR_DEFAULTS; i++) {
+			struct nas_sensors_info *p = nas_sensors + i;
+			nas_sensor_set_defaults(p);
+			p->type = nas_sensor_find_type(nas_sensor_defaults[i].type);
+			p->role = nas_sensor_defaults[i].role;
+			p->summary = nas_sensor_defaults[i].summary;
+			snprintf(p->label, sizeof(p->label), "%s", nas_sensor_defaults[i].label);
+			snprintf(p->title, sizeof(p->title), "%s", nas_sensor_defaults[i].title);
+		}
+		nas_sensors_count = NAS_SENSOR_DEFAULTS;
+#ifdef NAS_NO_LIBSENSORS
+		/* the labels come from sensors.conf, a chip without *_label files needs [sensor] sections */
+		syslog(LOG_WARNING, "built-in sensor table matched against hwmon labels only, "
+				    "configure [sensor] sections with attr and scale if none is found");
+#endif
+		return;
+	}
+
+	for (int sec = nas_conf_next("sensor", -1); sec >= 0; sec = nas_conf_next("sensor", sec)) {
+		struct nas_sensors_info *p = nas_sensors + nas_sensors_count;
+		const char *label = nas_conf_get(sec, "label");
+		const char *type = nas_conf_get(sec, "type");
+		const char *role = nas_conf_get(sec, "role");
+		const char *title = nas_conf_get(sec, "title");
+		const char *chip = nas_conf_get(sec, "chip");
+		const char *attr = nas_conf_get(sec, "attr");
+
+		nas_sensor_set_defaults(p);
+		if ((label == NULL) || (type == NULL) || ((p->type = nas_sensor_find_type(type)) == NULL)) {
+			syslog(LOG_ERR, "sensor config needs label and a valid type");
+			exit(EXIT_FAILURE);
+		}
+
+		if (role != NULL) {
+			int r = nas_sensor_find_role(role);
+			if (r < 0) {
+				syslog(LOG_ERR, "sensor %s: unknown role %s", label, role);
+				exit(EXIT_FAILURE);
+			}
+			p->role = (unsigned char)r;
+		} else if (strcmp(p->type->name, "fan") == 0)
+			p->role = NAS_SENSOR_ROLE_FAN;
+		else
+			p->role = NAS_SENSOR_ROLE_RAIL;
+
+		snprintf(p->label, sizeof(p->label), "%s", label);
+		snprintf(p->title, sizeof(p->title), "%s", title != NULL ? title : label);
+		if (chip != NULL)
+			snprintf(p->chip_pattern, sizeof(p->chip_pattern), "%s", chip);
+		if (attr != NULL)
+			snprintf(p->attr, sizeof(p->attr), "%s", attr);
+		p->scale = nas_conf_get_double(sec, "scale", NAN);
+		p->offset = nas_conf_get_double(sec, "offset", 0);
+		p->summary = (unsigned char)nas_conf_get_bool(sec, "summary", 0);
+		p->min = nas_conf_get_double(sec, "min", NAN);
+		p->max = nas_conf_get_double(sec, "max", NAN);
+		p->notice = nas_conf_get_double(sec, "notice", NAN);
+		p->halt = nas_conf_get_double(sec, "halt", NAN);
+		nas_sensors_count++;
+	}
+}
+
+static int nas_sensor_find_first(const int role) {
+	for (int i = 0; i < nas_sensors_count; i++) {
+		if (nas_sensors[i].role == role)
+			return i;
+	}
+	return -1;
+}
+
+/* open <path>/<attr>_<item> */
+static int nas_sensor_open_attr(const struct nas_sensors_info *p, const char *item) {
+	char name[strlen(p->path) + sizeof(p->attr) + 16];
+
+	snprintf(name, sizeof(name), "%s/%s_%s", p->path, p->attr, item);
+	return open(name, O_RDONLY);
+}
+
+static int nas_sensor_read_fd(const struct nas_sensors_info *p, const int fd, double *value) {
+	long raw;
+
+	if (nas_pread_long(fd, &raw) != 0)
+		return -1;
+
+	*value = (double)raw * p->type->unit * p->scale + p->offset;
+	return 0;
+}
 
+static int nas_sensor_read_raw(const struct nas_sensors_info *p, double *value) {
+	return nas_sensor_read_fd(p, p->fd, value);
+}
+
+#ifndef NAS_NO_LIBSENSORS
+static struct nas_sensors_info *nas_sensor_match(const char *chip_name, const sensors_feature *feature,
+						 const char *label) {
+	for (int i = 0; i < nas_sensors_count; i++) {
+		struct nas_sensors_info *p = nas_sensors + i;
+		if ((p->chip == NULL) && (p->type->feature_type == feature->type) &&
+		    ((strcmp(p->label, label) == 0) || (strcmp(p->attr, feature->name) == 0)) &&
+		    ((p->chip_pattern[0] == '\0') || (fnmatch(p->chip_pattern, chip_name, 0) == 0)))
+			return p;
+	}
+	return NULL;
+}
+
+/* recursive descent over a compute expression of sensors.conf, @ is the raw value */
+static double nas_compute_expr(const char **s, double x);
+
+static void nas_compute_space(const char **s) {
+	while ((**s == ' ') || (**s == '\t'))
+		(*s)++;
+}
+
+/* NAN on anything but numbers, @, + - * /, ^ (exp), ` (log) and parentheses, e.g. another feature */
+static double nas_compute_primary(const char **s, const double x) {
+	char *end;
+	double v;
+
+	nas_compute_space(s);
+	switch (**s) {
+		case '@':
+			(*s)++;
+			return x;
+		case '-':
+			(*s)++;
+			return -nas_compute_primary(s, x);
+		case '^':
+			(*s)++;
+			return exp(nas_compute_primary(s, x));
+		case '`':
+			(*s)++;
+			return log(nas_compute_primary(s, x));
+		case '(':
+			(*s)++;
+			v = nas_compute_expr(s, x);
+			nas_compute_space(s);
+			if (**s != ')')
+				return NAN;
+			(*s)++;
+			return v;
+		default:
+			if (((**s < '0') || (**s > '9')) && (**s != '.'))
+				return NAN;
+			v = strtod(*s, &end);
+			*s = end;
+			return v;
+	}
+}
+
+static double nas_compute_term(const char **s, const double x) {
+	double v = nas_compute_primary(s, x);
+
+	while (1) {
+		nas_compute_space(s);
+		if (**s == '*') {
+			(*s)++;
+			v *= nas_compute_primary(s, x);
+		} else if (**s == '/') {
+			(*s)++;
+			v /= nas_compute_primary(s, x);
+		} else
+			return v;
+	}
+}
+
+static double nas_compute_expr(const char **s, const double x) {
+	double v = nas_compute_term(s, x);
+
+	while (1) {
+		nas_compute_space(s);
+		if (**s == '+') {
+			(*s)++;
+			v += nas_compute_term(s, x);
+		} else if (**s == '-') {
+			(*s)++;
+			v -= nas_compute_term(s, x);
+		} else
+			return v;
+	}
+}
+
+static double nas_compute_eval(const char *expr, const double x) {
+	const char *s = expr;
+	double v = nas_compute_expr(&s, x);
+
+	nas_compute_space(&s);
+	return *s == '\0' ? v : NAN;
+}
+
+/*
+ * value = @ * scale only: the expression must go through 0 and be linear
+ * at every probe point. An offset, a non-linear or an unparsable
+ * expression returns -1, the sensor is then read through libsensors.
+ */
+static int nas_sensor_fold_compute(const char *expr, double *scale) {
+	static const double probes[] = {0.5, 10, 1000, -100};
+
+	if (expr[0] == '\0') {
+		*scale = 1;
+		return 0;
+	}
+
+	double k = nas_compute_eval(expr, 1);
+	if (!isfinite(k) || (k == 0) || !(fabs(nas_compute_eval(expr, 0)) < 1e-9 * fabs(k)))
+		return -1;
+
+	for (int i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+		if (!(fabs(nas_compute_eval(expr, probes[i]) - k * probes[i]) <= 1e-9 * fabs(k * probes[i])))
+			return -1;
+	}
+
+	*scale = k;
+	return 0;
+}
+
+/*
+ * the forward compute expression of a feature in sensors.conf, from the
+ * last chip statement matching the chip, as libsensors picks it; empty
+ * if there is none
+ */
+static void nas_sensor_find_compute(const char *conf, const char *chip_name, const char *feature, char *expr,
+				    const size_t len) {
+	char line[512];
+	int match = 0;
+
+	expr[0] = '\0';
+	FILE *fp = fopen(conf, "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *save = NULL;
+		char *hash = strchr(line, '#');
+
+		if (hash != NULL)
+			*hash = '\0';
+
+		char *tok = strtok_r(line, " \t\r\n", &save);
+		if (tok == NULL)
+			continue;
+
+		if (strcmp(tok, "chip") == 0) {
+			match = 0;
+			while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+				size_t n = strlen(tok);
+				if ((n >= 2) && (tok[0] == '"') && (tok[n - 1] == '"')) {
+					tok[n - 1] = '\0';
+					tok++;
+				}
+				if (fnmatch(tok, chip_name, 0) == 0)
+					match = 1;
+			}
+		} else if (match && (strcmp(tok, "compute") == 0)) {
+			/* compute FEATURE FORWARD, INVERSE */
+			tok = strtok_r(NULL, " \t\r\n", &save);
+			if ((tok == NULL) || (strcmp(tok, feature) != 0))
+				continue;
+			char *rest = strtok_r(NULL, ",", &save);
+			if (rest == NULL)
+				continue;
+			size_t n = strlen(rest);
+			while ((n > 0) && (strchr(" \t\r\n", rest[n - 1]) != NULL))
+				n--;
+			snprintf(expr, len, "%.*s", (int)n, rest);
+		}
+	}
+	fclose(fp);
+}
+
+static void nas_sensor_bind(const char *conf) {
 	FILE *fp = fopen(conf, "r");
 	if (fp == NULL) {
 		syslog(LOG_ERR, "Open sensors config file failed: %d", errno);
@@ -156,8 +471,6 @@ void nas_sensor_init(const char *conf) {
 	}
 	fclose(fp);
 
-	atexit(nas_sensor_free);
-
 	const sensors_chip_name *chip;
 	const sensors_feature *feature;
 	const sensors_subfeature *subfeature;
@@ -166,7 +479,6 @@ void nas_sensor_init(const char *conf) {
 	char chip_name[64];
 	char *label;
 	double value;
-	int err = 0;
 	struct nas_sensors_info *pinfo;
 
 	while ((chip = sensors_get_detected_chips(NULL, &nr)) != NULL) {
@@ -179,10 +491,9 @@ void nas_sensor_init(const char *conf) {
 		while ((feature = sensors_get_features(chip, &fnr)) != NULL) {
 			label = sensors_get_label(chip, feature);
 			if (label == NULL) {
-				syslog(LOG_ERR, "can not get feature label for %s %s",
+				syslog(LOG_WARNING, "can not get feature label for %s %s",
 				       chip_name, feature->name);
-				err = -1;
-				break;
+				continue;
 			}
 #ifndef NDEBUG
 			syslog(LOG_DEBUG, "feature(%d): %s(%s), number=%d, type=%d",
@@ -190,15 +501,12 @@ void nas_sensor_init(const char *conf) {
 			       feature->type);
 #endif
 
-			pinfo = NULL;
-			for (int i = 0; i < NAS_SENSORS_COUNT; i++) {
-				if ((nas_sensors[i].feature_type == feature->type) &&
-				    (strcmp(nas_sensors[i].label, label) == 0)) {
-					pinfo = nas_sensors + i;
-					pinfo->chip = chip;
-					pinfo->feature = feature;
-					break;
-				}
+			pinfo = nas_sensor_match(chip_name, feature, label);
+			if (pinfo != NULL) {
+				pinfo->chip = chip;
+				snprintf(pinfo->attr, sizeof(pinfo->attr), "%s", feature->name);
+				if (chip->path != NULL)
+					pinfo->path = strdup(chip->path);
 			}
 
 			sfnr = 0;
@@ -214,12 +522,13 @@ void nas_sensor_init(const char *conf) {
 #endif
 
 				if (pinfo != NULL) {
-					if (subfeature->type == pinfo->subfeature_input) {
+					/* configured limits take precedence over the chip ones */
+					if (subfeature->type == pinfo->type->subfeature_input) {
 						pinfo->value = value;
 						pinfo->nr = subfeature->number;
-					} else if (subfeature->type == pinfo->subfeature_min)
+					} else if ((subfeature->type == pinfo->type->subfeature_min) && isnan(pinfo->min))
 						pinfo->min = value;
-					else if (subfeature->type == pinfo->subfeature_max)
+					else if ((subfeature->type == pinfo->type->subfeature_max) && isnan(pinfo->max))
 						pinfo->max = value;
 				}
 			}
@@ -235,33 +544,264 @@ void nas_sensor_init(const char *conf) {
 		}
 	}
 
-	if (!err) {
-		for (int i = 0; i < NAS_SENSORS_COUNT; i++) {
-			if (nas_sensors[i].chip == NULL) {
-				syslog(LOG_ERR, "sensor %s missed", nas_sensors[i].label);
-				err--;
+	/* fold the compute expression of each sensor into scale, once */
+	for (int i = 0; i < nas_sensors_count; i++) {
+		struct nas_sensors_info *p = nas_sensors + i;
+		char expr[128];
+		double scale;
+
+		if ((p->chip == NULL) || (p->nr < 0) || (p->path == NULL))
+			continue;
+
+		if ((p->fd = nas_sensor_open_attr(p, "input")) < 0) {
+			syslog(LOG_INFO, "sensor %s: no sysfs attribute, use libsensors", p->label);
+			continue;
+		}
+
+		if (!isnan(p->scale))
+			continue;
+
+		sensors_snprintf_chip_name(chip_name, sizeof(chip_name), p->chip);
+		nas_sensor_find_compute(conf, chip_name, p->attr, expr, sizeof(expr));
+		if (nas_sensor_fold_compute(expr, &scale) != 0) {
+			syslog(LOG_INFO, "sensor %s: compute %s is not a plain factor, use libsensors", p->label, expr);
+			nas_safe_close(p->fd);
+			p->fd = -1;
+			continue;
+		}
+		p->scale = scale;
+	}
+}
+
+static int nas_sensor_bound(const struct nas_sensors_info *p) {
+	return (p->chip != NULL) && (p->nr >= 0);
+}
+#else
+static double nas_sensor_read_limit(const struct nas_sensors_info *p, const char *item) {
+	double value = NAN;
+	int fd = nas_sensor_open_attr(p, item);
+
+	if (fd >= 0) {
+		if (nas_sensor_read_fd(p, fd, &value) != 0)
+			value = NAN;
+		nas_safe_close(fd);
+	}
+	return value;
+}
+
+/* match one hwmon device against the configured sensors */
+static void nas_sensor_bind_hwmon(const char *path, const char *chip_name) {
+	char name[strlen(path) + 64];
+	char label[64];
+	struct dirent *ent;
+
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	while ((ent = readdir(dir)) != NULL) {
+		/* <type><n>_input */
+		char *sep = strchr(ent->d_name, '_');
+		if ((sep == NULL) || (strcmp(sep, "_input") != 0) || (sep - ent->d_name >= sizeof(label)))
+			continue;
+
+		char attr[sizeof(((struct nas_sensors_info *)0)->attr)];
+		snprintf(attr, sizeof(attr), "%.*s", (int)(sep - ent->d_name), ent->d_name);
+
+		snprintf(name, sizeof(name), "%s/%s_label", path, attr);
+		int len = nas_read_file(name, label, sizeof(label) - 1);
+		if (len > 0) {
+			while ((len > 0) && (label[len - 1] == '\n'))
+				len--;
+			label[len] = '\0';
+		} else
+			snprintf(label, sizeof(label), "%s", attr);
+
+		for (int i = 0; i < nas_sensors_count; i++) {
+			struct nas_sensors_info *p = nas_sensors + i;
+			size_t type_len = strlen(p->type->name);
+
+			if ((p->path != NULL) || (strncmp(attr, p->type->name, type_len) != 0) ||
+			    (attr[type_len] < '0') || (attr[type_len] > '9'))
+				continue;
+
+			if ((strcmp(p->label, label) != 0) && (strcmp(p->attr, attr) != 0))
+				continue;
+
+			/* libsensors chip patterns, e.g. it8721-*, compare the prefix */
+			if (p->chip_pattern[0] != '\0') {
+				char prefix[sizeof(p->chip_pattern)];
+				snprintf(prefix, sizeof(prefix), "%s", p->chip_pattern);
+				char *dash = strchr(prefix, '-');
+				if (dash != NULL)
+					*dash = '\0';
+				if (fnmatch(prefix, chip_name, 0) != 0)
+					continue;
 			}
+
+			snprintf(p->attr, sizeof(p->attr), "%s", attr);
+			p->path = strdup(path);
+			if ((p->fd = nas_sensor_open_attr(p, "input")) < 0)
+				break;
+
+			if (isnan(p->scale))
+				p->scale = 1;
+			nas_sensor_read_raw(p, &p->value);
+			if (isnan(p->min))
+				p->min = nas_sensor_read_limit(p, "min");
+			if (isnan(p->max))
+				p->max = nas_sensor_read_limit(p, "max");
+
+			syslog(LOG_INFO, "sensor %s, %s/%s, value=%f, min=%f, max=%f",
+			       p->label, chip_name, attr, p->value, p->min, p->max);
+			break;
+		}
+	}
+	closedir(dir);
+}
+
+static void nas_sensor_bind(const char *conf) {
+	char path[64];
+	char name[64];
+	struct dirent *ent;
+
+	DIR *dir = opendir("/sys/class/hwmon");
+	if (dir == NULL) {
+		syslog(LOG_ERR, "open hwmon class dir failed: %d", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%.32s/name", ent->d_name);
+		int len = nas_read_file(path, name, sizeof(name) - 1);
+		if (len <= 0)
+			continue;
+		while ((len > 0) && (name[len - 1] == '\n'))
+			len--;
+		name[len] = '\0';
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%.32s", ent->d_name);
+		nas_sensor_bind_hwmon(path, name);
+	}
+	closedir(dir);
+}
+
+static int nas_sensor_bound(const struct nas_sensors_info *p) {
+	return p->fd >= 0;
+}
+#endif
+
+void nas_sensor_init(const char *conf) {
+	nas_sensor_load_conf();
+	atexit(nas_sensor_free);
+
+	nas_sensor_bind(conf);
+
+	/* drop missing sensors, keep the table contiguous */
+	int count = 0;
+	for (int i = 0; i < nas_sensors_count; i++) {
+		struct nas_sensors_info *p = nas_sensors + i;
+
+		if (!nas_sensor_bound(p)) {
+			syslog(LOG_WARNING, "sensor %s missed", p->label);
+			if (p->fd >= 0)
+				nas_safe_close(p->fd);
+			free(p->path);
+			continue;
 		}
+
+		if (isnan(p->min))
+			p->min = 0;
+		if (isnan(p->max))
+			p->max = 0;
+
+		if (p->role == NAS_SENSOR_ROLE_CPU) {
+			if (isnan(p->notice))
+				p->notice = cpu_temp_notice;
+			if (isnan(p->halt))
+				p->halt = cpu_temp_halt;
+		} else if (p->role == NAS_SENSOR_ROLE_BOARD) {
+			if (isnan(p->notice))
+				p->notice = sys_temp_notice;
+			/* without a chip limit there is no full speed point, a fan curve would run backwards */
+			if (isnan(p->halt) && (p->max > p->notice))
+				p->halt = p->max;
+			if (!(p->halt > p->notice))
+				syslog(LOG_WARNING, "sensor %s: no halt temperature above notice %.0f, not a fan input "
+						    "without halt or a curve", p->label, p->notice);
+		}
+
+		if (p->fd >= 0)
+			syslog(LOG_INFO, "sensor %s: read %s/%s_input, scale %g", p->label, p->path, p->attr,
+			       p->scale);
+		nas_stats_init(&(p->stats), p->type->outlier_abs, p->type->outlier_rel, p->type->drift_abs,
+			       p->type->drift_rel);
+
+		/* the first read arms sysfs_notify, otherwise the fd reports ready at once */
+		if ((p->path != NULL) && ((p->alarm_fd = nas_sensor_open_attr(p, "alarm")) >= 0)) {
+			long alarm;
+			if (nas_pread_long(p->alarm_fd, &alarm) != 0) {
+				nas_safe_close(p->alarm_fd);
+				p->alarm_fd = -1;
+			} else if (alarm != 0)
+				syslog(LOG_WARNING, "sensor %s: alarm already raised", p->label);
+		}
+
+		if (count != i)
+			nas_sensors[count] = *p;
+		count++;
 	}
+	nas_sensors_count = count;
 
-	if (err != 0) {
-		syslog(LOG_ERR, "sensors initialization failed");
+	if (nas_sensors_count == 0) {
+		syslog(LOG_ERR, "sensors initialization failed, no sensor found");
 		exit(EXIT_FAILURE);
 	}
 
-	syslog(LOG_INFO, "CPU guard temperature: %.0f -> %.0f",
-	       cpu_temp_notice, cpu_temp_halt);
-	syslog(LOG_INFO, "Mother board guard temperature: %.0f -> %.0f",
-	       sys_temp_notice, nas_sensors[NAS_SENSOR_System].max);
+	for (int i = 0; i < nas_sensors_count; i++) {
+		const struct nas_sensors_info *p = nas_sensors + i;
+		if ((p->role == NAS_SENSOR_ROLE_CPU) || (p->role == NAS_SENSOR_ROLE_BOARD))
+			syslog(LOG_INFO, "%s guard temperature: %.0f -> %.0f", p->label, p->notice, p->halt);
+	}
+}
+
+static int nas_sensor_read(struct nas_sensors_info *p) {
+	if (p->fd >= 0)
+		return nas_sensor_read_raw(p, &(p->value));
+
+#ifndef NAS_NO_LIBSENSORS
+	return sensors_get_value(p->chip, p->nr, &(p->value));
+#else
+	return -1;
+#endif
+}
+
+/* fds of the *_alarm attributes, to wait for with EPOLLPRI */
+int nas_sensor_alarm_fds(int *fds, const int max) {
+	int n = 0;
+	for (int i = 0; (i < nas_sensors_count) && (n < max); i++) {
+		if (nas_sensors[i].alarm_fd >= 0)
+			fds[n++] = nas_sensors[i].alarm_fd;
+	}
+	return n;
 }
 
-static int nas_sensor_check(struct nas_sensors_info *p) {
+/* alarm: the chip raised the alarm of the sensor, the reading is no glitch */
+static int nas_sensor_check(struct nas_sensors_info *p, const int alarm) {
 	int err = 0;
-	sensors_get_value(p->chip, p->nr, &(p->value));
+	double last = p->value;
+	int drift = p->stats.drift;
+
+	if (nas_sensor_read(p) != 0)
+		return 0;
 #ifndef NDEBUG
 	syslog(LOG_DEBUG, "%s: value %.2f", p->label, p->value);
 #endif
 
+	/* the limits see the raw reading, a real jump over them must not wait for the outlier filter */
 	if (p->value < p->min) {
 		err++;
 		syslog(LOG_ALERT, "sensor %s: value %.2f below low limit(%f)",
@@ -272,114 +812,238 @@ static int nas_sensor_check(struct nas_sensors_info *p) {
 		       p->label, p->value, p->max);
 	}
 
+	/* a single bad reading must not reach the fan logic */
+	int rc = nas_stats_add(&(p->stats), p->value);
+	if (rc & NAS_STATS_OUTLIER) {
+		if (!alarm && (err == 0)) {
+			syslog(LOG_NOTICE, "sensor %s: reject outlier %.3f, median %.3f", p->label, p->value,
+			       nas_stats_median(&(p->stats)));
+			p->value = last;
+			return 0;
+		}
+		/* vouched for by the chip or a limit, a step to a new level */
+		nas_stats_restart(&(p->stats));
+		rc = nas_stats_add(&(p->stats), p->value);
+	}
+	p->reads++;
+	if ((rc & NAS_STATS_DRIFT) && !drift)
+		syslog(LOG_WARNING, "sensor %s: drift to %.3f from baseline %.3f", p->label, p->stats.ewma,
+		       p->stats.baseline);
+	else if (drift && !p->stats.drift)
+		syslog(LOG_NOTICE, "sensor %s: back to baseline %.3f", p->label, p->stats.baseline);
+
 	return err;
 }
 
-int nas_sensor_update(time_t now) {
-	static time_t last_tick = 0;
+/*
+ * An *_alarm attribute changed: re-arm it, and check the sensor right
+ * away. Return -1 if fd is not an alarm, else the number of violations.
+ */
+int nas_sensor_alarm(const int fd) {
+	for (int i = 0; i < nas_sensors_count; i++) {
+		struct nas_sensors_info *p = nas_sensors + i;
+		long alarm = 0;
 
-	int err = nas_sensor_check(&(nas_sensors[NAS_SENSOR_CPU]));
+		if (p->alarm_fd != fd)
+			continue;
 
-	if (now - last_tick >= update_interval) {
-		for (enum nas_sensors_ids id = NAS_SENSOR_MIN;
-		     id < NAS_SENSORS_COUNT; id++) {
-			if (id != NAS_SENSOR_CPU)
-				err += nas_sensor_check(&(nas_sensors[id]));
+		/*
+		 * EPOLLERR comes with every sysfs_notify, only a failed read tells
+		 * an unbound hwmon device, whose fd would then be ready forever
+		 */
+		if (nas_pread_long(fd, &alarm) != 0) {
+			syslog(LOG_WARNING, "sensor %s: alarm unreadable: %d, poll it instead", p->label, errno);
+			nas_event_unwatch(fd);
+			nas_safe_close(fd);
+			p->alarm_fd = -1;
+			return 0;
 		}
+		syslog(alarm ? LOG_WARNING : LOG_NOTICE, "sensor %s: alarm %s", p->label, alarm ? "raised" : "cleared");
+		return nas_sensor_check(p, alarm != 0);
+	}
+	return -1;
+}
 
-		last_tick = now;
+/* time rounds of reads through each backend, for --bench_sensors */
+void nas_sensor_bench(const int rounds) {
+	struct timespec t0, t1;
+	double ns;
+	int reads;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	reads = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < nas_sensors_count; i++) {
+			if (nas_sensors[i].fd >= 0) {
+				nas_sensor_read_raw(nas_sensors + i, &nas_sensors[i].value);
+				reads++;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	printf("sysfs pread:  %d reads, %.0f ns/read\n", reads, reads ? ns / reads : 0);
+
+#ifndef NAS_NO_LIBSENSORS
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	reads = 0;
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < nas_sensors_count; i++) {
+			sensors_get_value(nas_sensors[i].chip, nas_sensors[i].nr, &nas_sensors[i].value);
+			reads++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	printf("libsensors:   %d reads, %.0f ns/read\n", reads, reads ? ns / reads : 0);
+#endif
+}
+
+int nas_sensor_update(time_t now) {
+	static time_t last_tick = 0;
+	static time_t last_alarm_tick = 0;
+	int err = 0;
+
+	/* CPU temperature and fan speed close the fan loop, they are read on every tick */
+	int all = now - last_tick >= update_interval;
+	int alarmed = now - last_alarm_tick >= alarm_update_interval;
+	for (int i = 0; i < nas_sensors_count; i++) {
+		const struct nas_sensors_info *p = nas_sensors + i;
+		if ((p->role == NAS_SENSOR_ROLE_CPU) || (p->role == NAS_SENSOR_ROLE_FAN) ||
+		    (p->alarm_fd >= 0 ? alarmed : all))
+			err += nas_sensor_check(nas_sensors + i, 0);
 	}
 
+	if (all)
+		last_tick = now;
+	if (alarmed)
+		last_alarm_tick = now;
+
 	return err;
 }
 
-int nas_sensor_get_pwm(void) {
-	double t1 = nas_sensors[NAS_SENSOR_CPU].value;
-	double t2, pwm_cpu, pwm_mb;
-	int pwm;
-
-	/* update temperature buffer */
-	if (temp_buf[0] < 0)
-		nas_sensor_temp_init(temp_buf, t1);
-	else {
-		int i = 0, j = 1;
-		while (j < TEMP_BUF_LEN) {
-			temp_buf[i] = temp_buf[j];
-			i = j;
-			j++;
-		}
-		temp_buf[i] = t1;
+/* every sensor on every call, whatever its poll interval: the calibration samples them each tick */
+int nas_sensor_update_all(void) {
+	int err = 0;
+
+	for (int i = 0; i < nas_sensors_count; i++)
+		err += nas_sensor_check(nas_sensors + i, 0);
+	return err;
+}
+
+/* cpu and board temperatures, the thermal inputs of the fan controllers */
+int nas_sensor_next_thermal(const int prev) {
+	for (int i = prev + 1; i < nas_sensors_count; i++) {
+		if ((nas_sensors[i].role == NAS_SENSOR_ROLE_CPU) || (nas_sensors[i].role == NAS_SENSOR_ROLE_BOARD))
+			return i;
 	}
+	return -1;
+}
 
-	/* calculate weighted temperature */
-	t2 = 0.05 * temp_buf[0] + 0.075 * temp_buf[1] + 0.1125 * temp_buf[2] +
-	     0.1688 * temp_buf[3] + 0.2532 * temp_buf[4] + 0.3405 * t1;
+/* tachometers, the feedback of the fans */
+int nas_sensor_next_fan(const int prev) {
+	for (int i = prev + 1; i < nas_sensors_count; i++) {
+		if (nas_sensors[i].role == NAS_SENSOR_ROLE_FAN)
+			return i;
+	}
+	return -1;
+}
 
-	/* if temperature is decreasing, no need to speed fan */
-	if (t2 > t1)
-		t2 = t1;
+int nas_sensor_find(const char *label) {
+	for (int i = 0; i < nas_sensors_count; i++) {
+		if (strcmp(nas_sensors[i].label, label) == 0)
+			return i;
+	}
+	return -1;
+}
 
-	pwm_cpu = (t2 - cpu_temp_notice) / (cpu_temp_halt - cpu_temp_notice);
+const char *nas_sensor_label(const int id) {
+	return nas_sensors[id].label;
+}
 
-	/* also consider the temperature of main board */
-	t1 = nas_sensors[NAS_SENSOR_System].value;
-	pwm_mb = (t1 - sys_temp_notice) / (nas_sensors[NAS_SENSOR_System].max - sys_temp_notice);
+double nas_sensor_value(const int id) {
+	return nas_sensors[id].value;
+}
 
-	pwm = (int)(255.0 * (pwm_cpu > pwm_mb ? pwm_cpu : pwm_mb));
-	if (pwm < 0)
-		pwm = 0;
-	else if (pwm > 255)
-		pwm = 255;
+/* smallest distance of a CPU temperature to its halt, C */
+double nas_sensor_cpu_margin(void) {
+	double margin = INFINITY;
+	for (int i = 0; i < nas_sensors_count; i++) {
+		const struct nas_sensors_info *p = nas_sensors + i;
+		if ((p->role == NAS_SENSOR_ROLE_CPU) && (p->halt - p->value < margin))
+			margin = p->halt - p->value;
+	}
+	return margin;
+}
 
-#ifndef NDEBUG
-	syslog(LOG_DEBUG, "cpu temp: %.2f, sys temp: %.2f, pwm output %d", t2, t1, pwm);
-#endif
+unsigned long nas_sensor_reads(const int id) {
+	return nas_sensors[id].reads;
+}
+
+/* seconds between two reads by nas_sensor_update, 0 if read on every tick */
+time_t nas_sensor_interval(const int id) {
+	const struct nas_sensors_info *p = nas_sensors + id;
 
-	return pwm;
+	if ((p->role == NAS_SENSOR_ROLE_CPU) || (p->role == NAS_SENSOR_ROLE_FAN))
+		return 0;
+	return p->alarm_fd >= 0 ? alarm_update_interval : update_interval;
 }
 
-static const char *nas_sensor_fmt[NAS_SENSORS_COUNT][2] = {
-	{"CPU Temp:",     "%.1f C"},
-	{"System Temp:",  "%.1f C"},
-	{"System Fan:",   "%.0f RPM"},
-	{"Voltage Core:", "%.6f V"},
-	{"Voltage V1.2:", "%.6f V"},
-	{"Voltage V3.3:", "%.6f V"},
-	{"Voltage V5.0:", "%.6f V"},
-	{"Voltage V+12:", "%.6f V"},
-};
+/* high limit checked by nas_sensor_update, 0 if none */
+double nas_sensor_max(const int id) {
+	return nas_sensors[id].max;
+}
+
+void nas_sensor_limits(const int id, double *notice, double *halt) {
+	*notice = nas_sensors[id].notice;
+	*halt = nas_sensors[id].halt;
+}
 
 int nas_sensor_item_show(const int off) {
 	static int id = -1;
 
-	id = id >= 0 ? (NAS_SENSORS_COUNT + id + off) % NAS_SENSORS_COUNT : 0;
+	id = id >= 0 ? (nas_sensors_count + id + off) % nas_sensors_count : 0;
 
-	lcd_printf(1, nas_sensor_fmt[id][0]);
-	lcd_printf(2, nas_sensor_fmt[id][1], nas_sensors[id].value);
+	lcd_printf(1, nas_sensors[id].title);
+	lcd_printf(2, nas_sensors[id].type->fmt, nas_sensors[id].value);
 
 	return id;
 }
 
 void nas_sensor_summary_show(void) {
+	int cpu = nas_sensor_find_first(NAS_SENSOR_ROLE_CPU);
+	int board = nas_sensor_find_first(NAS_SENSOR_ROLE_BOARD);
+	int fan = nas_sensor_find_first(NAS_SENSOR_ROLE_FAN);
+	double rails[3] = {0, 0, 0};
+	int n = 0;
+
 	lcd_printf(1, "%.0fC %.0fC %.0fRPM",
-		   nas_sensors[NAS_SENSOR_CPU].value,
-		   nas_sensors[NAS_SENSOR_System].value,
-		   nas_sensors[NAS_SENSOR_Fan].value);
-	lcd_printf(2, "%.2f %.2f %.2f", nas_sensors[NAS_SENSOR_Vcore].value,
-		   nas_sensors[NAS_SENSOR_V5_0].value,
-		   nas_sensors[NAS_SENSOR_V12].value);
+		   cpu >= 0 ? nas_sensors[cpu].value : 0,
+		   board >= 0 ? nas_sensors[board].value : 0,
+		   fan >= 0 ? nas_sensors[fan].value : 0);
+
+	/* rails marked for summary, or the first ones */
+	for (int pass = 0; pass < 2 && n == 0; pass++) {
+		for (int i = 0; (i < nas_sensors_count) && (n < 3); i++) {
+			if ((nas_sensors[i].role == NAS_SENSOR_ROLE_RAIL) && (pass || nas_sensors[i].summary))
+				rails[n++] = nas_sensors[i].value;
+		}
+	}
+	lcd_printf(2, "%.2f %.2f %.2f", rails[0], rails[1], rails[2]);
 }
 
 int nas_sensor_to_json(char *buf, const size_t len) {
 	int count = 0;
-	for (int i = 0; i < NAS_SENSORS_COUNT; i++) {
+	for (int i = 0; i < nas_sensors_count; i++) {
 		if (i != 0)
 			buf[count++] = ',';
 
 		const struct nas_sensors_info *p = nas_sensors + i;
 		count += snprintf(buf + count, len - count,
-				  "\"%s\":{\"value\":%.3f,\"min\":%.3f,\"max\":%.3f}",
-				  p->label, p->value, p->min, p->max);
+				  "\"%s\":{\"value\":%.3f,\"min\":%.3f,\"max\":%.3f,\"role\":\"%s\",\"stats\":",
+				  p->label, p->value, p->min, p->max, nas_sensor_role_names[p->role]);
+		count += nas_stats_to_json(&(p->stats), buf + count, len - count);
+		buf[count++] = '}';
 	}
 	return count;
 }
@@ -9,6 +9,12 @@
 #include <scsi/scsi_ioctl.h>
 #include <byteswap.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <math.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unitypes.h>
@@ -33,6 +39,11 @@ int ssd_temp_halt = 70;
 static int hdd_temp = 0;
 static int ssd_temp = 0;
 
+/* hottest temperature actually read in the last pass of each kind (hdd, ssd), for the thermal guard */
+static int disk_guard_temp[2];
+static int disk_guard_disks[2];     /* the disks that pass read */
+static unsigned long disk_guard_gen[2];
+
 enum e_powermode {
 	PWM_UNKNOWN,
 	PWM_ACTIVE,
@@ -40,8 +51,28 @@ enum e_powermode {
 	PWM_STANDBY
 };
 
+#define NAS_DISK_CAP_SAT    0x01 /* ATA pass-thru accepted */
+#define NAS_DISK_CAP_SMART  0x02 /* S.M.A.R.T. enabled */
+#define NAS_DISK_CAP_SCT    0x04 /* SCT Command Transport supported */
+#define NAS_DISK_CAP_LP_TEMP 0x08 /* SCSI temperature log page */
+#define NAS_DISK_CAP_LP_IE  0x10 /* SCSI informational exceptions log page */
+
 /* Identify words offset of Nominal Media Rotation Rate  */
 static const int identify_offset_nmrr = 217;
+/* Identify words offset of SCT Command Transport, bit 0 is supported */
+static const int identify_offset_sct = 206;
+
+/* SCT status log address and the temperature bytes in it */
+#define SCT_STATUS_LOG          0xE0
+#define SCT_STATUS_TEMP_OFFSET  200
+#define SCT_TEMP_INVALID        ((signed char)0x80)
+
+/* SCSI log pages */
+#define LOG_PAGE_SUPPORTED      0x00
+#define LOG_PAGE_TEMPERATURE    0x0D
+#define LOG_PAGE_IE             0x2F
+/* VPD page of block device characteristics, bytes 4-5 are rotation rate */
+#define VPD_PAGE_BDC            0xB1
 
 /* default is 194 */
 static unsigned char temp_attr_ids[] = {194, 190};
@@ -151,7 +182,8 @@ static int scsi_send_command(const int fd, unsigned char *cdb, int cdb_len, unsi
 
 static int scsi_command(int device, unsigned char *cdb, int cdb_len, unsigned char *buffer, int buffer_len,
 			int dxfer_direction) {
-	static int sg_io_supported = -1;
+	/* shared by the probe workers, they all find the same answer */
+	static _Atomic int sg_io_supported = -1;
 	int ret;
 
 	if (sg_io_supported == 1)
@@ -188,6 +220,88 @@ static int scsi_inquiry(int device, unsigned char *buffer, const unsigned char s
 	return ret;
 }
 
+static int scsi_inquiry_vpd(int device, const unsigned char page, unsigned char *buffer, const unsigned char size) {
+	unsigned char cdb[6];
+
+	memset(cdb, 0, sizeof(cdb));
+	memset(buffer, 0, size);
+	cdb[0] = INQUIRY;
+	cdb[1] = 0x01; /* EVPD */
+	cdb[2] = page;
+	cdb[4] = size;
+
+	if (scsi_command(device, cdb, sizeof(cdb), buffer, size, SG_DXFER_FROM_DEV) != 0)
+		return -1;
+
+	return buffer[1] == page ? 0 : -1;
+}
+
+static int scsi_log_sense(int device, const unsigned char page, unsigned char *buffer, const int size) {
+	unsigned char cdb[10];
+
+	memset(cdb, 0, sizeof(cdb));
+	memset(buffer, 0, size);
+	cdb[0] = LOG_SENSE;
+	cdb[2] = 0x40 | page; /* cumulative values */
+	cdb[7] = (unsigned char)(size >> 8);
+	cdb[8] = (unsigned char)size;
+
+	if (scsi_command(device, cdb, sizeof(cdb), buffer, size, SG_DXFER_FROM_DEV) != 0)
+		return -1;
+
+	return (buffer[0] & 0x3f) == page ? 0 : -1;
+}
+
+static int scsi_probe(const int fd, char *model, const size_t len, unsigned int *caps) {
+	int bus_num;
+	unsigned char buf[36];
+	unsigned char pages[64];
+
+	if (ioctl(fd, SCSI_IOCTL_GET_BUS_NUMBER, &bus_num))
+		return 0;
+
+	if (scsi_inquiry(fd, buf, sizeof(buf)) || ((buf[0] & 0x1f) != TYPE_DISK))
+		return 0;
+	snprintf(model, len, "%s", (char *)buf + 8);
+
+	if (scsi_log_sense(fd, LOG_PAGE_SUPPORTED, pages, sizeof(pages)) != 0)
+		return 0;
+
+	if (scsi_log_supported(pages, sizeof(pages), LOG_PAGE_TEMPERATURE))
+		*caps |= NAS_DISK_CAP_LP_TEMP;
+	if (scsi_log_supported(pages, sizeof(pages), LOG_PAGE_IE))
+		*caps |= NAS_DISK_CAP_LP_IE;
+
+	return (*caps & (NAS_DISK_CAP_LP_TEMP | NAS_DISK_CAP_LP_IE)) ? 1 : 0;
+}
+
+static unsigned short scsi_rotation_rate(const int fd) {
+	unsigned char buf[64];
+
+	if (scsi_inquiry_vpd(fd, VPD_PAGE_BDC, buf, sizeof(buf)) != 0)
+		return 0;
+
+	return scsi_vpd_rotation_rate(buf, sizeof(buf));
+}
+
+/*
+ * ie: ASC and ASCQ of the most recent informational exception, 0 if the
+ * drive reports no failure prediction
+ */
+static char scsi_get_temperature(const int fd, const unsigned int caps, unsigned char *ie) {
+	unsigned char page[64];
+	char temp = 0, t;
+
+	if ((caps & NAS_DISK_CAP_LP_IE) && (scsi_log_sense(fd, LOG_PAGE_IE, page, sizeof(page)) == 0))
+		scsi_log_ie(page, sizeof(page), ie, &temp);
+
+	if ((caps & NAS_DISK_CAP_LP_TEMP) && (scsi_log_sense(fd, LOG_PAGE_TEMPERATURE, page, sizeof(page)) == 0) &&
+	    (scsi_log_temperature(page, sizeof(page), &t) == 0))
+		temp = t;
+
+	return temp;
+}
+
 static int sata_pass_thru(const int fd, const unsigned char *cmd, unsigned char *buffer) {
 	int dxfer_direction, ret;
 	unsigned char cdb[16], sense[32];
@@ -231,6 +345,11 @@ static inline int sata_get_smart_values(const int fd, unsigned char *buff) {
 	return sata_pass_thru(fd, cmd, buff);
 }
 
+static inline int sata_get_sct_status(const int fd, unsigned char *buff) {
+	unsigned char cmd[4] = {WIN_SMART, SCT_STATUS_LOG, SMART_READ_LOG_SECTOR, 1};
+	return sata_pass_thru(fd, cmd, buff);
+}
+
 static int sata_probe(const int fd) {
 	int bus_num;
 	unsigned char cmd[4] = {WIN_IDENTIFY, 0, 0, 1};
@@ -259,15 +378,18 @@ static int sata_probe(const int fd) {
 		return 1;
 }
 
-static unsigned short sata_model(const int fd, char *buf, const size_t len) {
+static unsigned short sata_model(const int fd, char *buf, const size_t len, unsigned int *caps) {
 	unsigned char cmd[4] = {WIN_IDENTIFY, 0, 0, 1};
 	unsigned char identify[512];
 
 	if (sata_pass_thru(fd, cmd, identify))
 		strncpy(buf, "unknown", len);
 	else {
-		hd_fixstring(identify + 54, 24, 1);
-		strncpy(buf, (char *)identify + 54, len);
+		hd_fixstring(identify + 54, 40, 1);
+		snprintf(buf, len, "%.40s", (char *)identify + 54);
+
+		if (identify[identify_offset_sct * 2] & 0x1)
+			*caps |= NAS_DISK_CAP_SCT;
 	}
 	return identify[identify_offset_nmrr * 2] |
 	       (((unsigned short)identify[identify_offset_nmrr * 2 + 1]) << 8);
@@ -311,32 +433,314 @@ static char sata_get_temperature(const int fd, const unsigned char attr_id) {
 	return temp;
 }
 
+/*
+ * range: power cycle min/max and lifetime min/max, SCT_TEMP_INVALID if
+ * not reported by the drive
+ */
+static char sata_get_sct_temperature(const int fd, signed char *range) {
+	unsigned char status[512];
+
+	if (sata_get_sct_status(fd, status) != 0) {
+		nas_log_error();
+		return 0;
+	}
+
+	memcpy(range, status + SCT_STATUS_TEMP_OFFSET + 1, 4);
+	if ((signed char)status[SCT_STATUS_TEMP_OFFSET] == SCT_TEMP_INVALID)
+		return 0;
+
+	return (char)status[SCT_STATUS_TEMP_OFFSET];
+}
+
+enum nas_disk_temp_source {
+	NAS_DISK_TEMP_SMART,
+	NAS_DISK_TEMP_HWMON,
+	NAS_DISK_TEMP_SCT,
+	NAS_DISK_TEMP_SCSI,
+	NAS_DISK_TEMP_SOURCES
+};
+
+static const char *nas_disk_temp_source_names[NAS_DISK_TEMP_SOURCES] = {
+	"smart",
+	"drivetemp",
+	"sct",
+	"logsense",
+};
+
+enum nas_disk_state {
+	NAS_DISK_HEALTHY,
+	NAS_DISK_DEGRADED, /* recent read failed, retried every poll */
+	NAS_DISK_FAILED,   /* too many failures, retried with backoff */
+	NAS_DISK_REMOVED,  /* device node gone, reopened with backoff */
+	NAS_DISK_STATES
+};
+
+static const char *nas_disk_state_names[NAS_DISK_STATES] = {
+	"healthy",
+	"degraded",
+	"failed",
+	"removed",
+};
+
+static const int disk_failures_max = 3;
+static const time_t disk_backoff_max = 3600;
+
+/* idle window per disk as DEV:SECONDS,..., "*" matches any disk, 0 disables */
+const char *disk_spindown_list = NULL;
+/* an early spin-up doubles the idle window, up to this factor */
+static const int disk_idle_scale_max = 8;
+/* the idle window goes back to normal after a day without thrashing */
+static const time_t disk_idle_scale_reset = 86400;
+
+/* fields of /sys/block/<dev>/stat */
+enum {
+	NAS_DISK_STAT_READ_IOS,
+	NAS_DISK_STAT_READ_MERGES,
+	NAS_DISK_STAT_READ_SECTORS,
+	NAS_DISK_STAT_READ_TICKS,
+	NAS_DISK_STAT_WRITE_IOS,
+	NAS_DISK_STAT_WRITE_MERGES,
+	NAS_DISK_STAT_WRITE_SECTORS,
+	NAS_DISK_STAT_WRITE_TICKS,
+	NAS_DISK_STAT_IN_FLIGHT,
+	NAS_DISK_STAT_IO_TICKS,
+	NAS_DISK_STAT_FIELDS
+};
+
+/* block layer load over the last tick */
+struct nas_disk_io {
+	unsigned long stat[NAS_DISK_STAT_FIELDS];
+	unsigned long inflight[2];  /* reads, writes */
+	struct timespec ts;
+	int samples;
+	double read_bps;
+	double write_bps;
+	double read_iops;
+	double write_iops;
+	double await;               /* ms per completed request */
+	double svctm;               /* ms busy per completed request */
+	double util;                /* % of the time with requests in flight */
+};
+
+/*
+ * Peer comparison: a failing drive in an array slows down before SMART
+ * notices. The service time of every busy tick goes into a sliding
+ * window kept sorted incrementally, and the median of each disk is
+ * compared with the median of its peers: the other disks of its
+ * [disk_peers] group or md array, or else the other HDDs/SSDs.
+ */
+#define DISK_PEER_WINDOW 60 /* busy ticks, 5 minutes of I/O */
+
+static const unsigned long disk_peer_min_ios = 10;  /* per tick, fewer is noise */
+static const int disk_peer_min_samples = 12;
+static const int disk_peer_min_peers = 2;           /* a median of one peer is no majority */
+static const double disk_peer_ratio = 2;            /* slow above twice the peers' service time */
+static const double disk_peer_margin = 5;           /* and at least 5ms more */
+static const int disk_peer_confirm = 12;            /* busy ticks in a row */
+
+struct nas_disk_peer {
+	int group;
+	const char *group_name;
+	double window[DISK_PEER_WINDOW];    /* in arrival order */
+	double sorted[DISK_PEER_WINDOW];
+	int pos;
+	int filled;
+	int fresh;                          /* a sample came in this tick */
+	double peers;                       /* median service time of the peers, 0 if none */
+	int confirm;
+	int slow;
+};
+
 struct nas_disk_info {
 	const char *name;
 	const char *model;
+	const char *key;
 	int fd;
+	int hwmon_fd;
+	unsigned int caps;
+	unsigned char temp_src;
 	unsigned char attr_id;
 	char temp;
+	signed char temp_range[4];
+	unsigned char ie[2];
 	unsigned short nmrr;
+	enum nas_disk_state state;
+	int failures;
+	time_t backoff;
+	time_t retry_ts;
+	int stat_fd;
+	int inflight_fd;
+	struct nas_disk_io io;
+	struct nas_disk_peer peer;
+	unsigned long ios;
+	time_t idle_window;
+	int idle_scale;
+	int standby;
+	int spinups;
+	time_t io_ts;
+	time_t standby_ts;
+	time_t thrash_ts;
+	struct nas_stats temp_stats;
 };
 
 static int nas_disk_count = 0;
 static struct nas_disk_info *nas_disk_list = NULL;
 
+/* identity cache, one line per known drive: key caps nmrr attr_id model */
+const char *disk_cache_file = "/var/cache/nasmon-disks";
+
+struct nas_disk_cache_entry {
+	char key[128];
+	char model[64];
+	unsigned int caps;
+	unsigned short nmrr;
+	unsigned char attr_id;
+};
+
+static int nas_disk_cache_count = 0;
+static int nas_disk_cache_size = 0;
+static _Atomic int nas_disk_cache_dirty = 0;     /* set by the probe workers */
+static struct nas_disk_cache_entry *nas_disk_cache = NULL;
+
+static struct nas_disk_cache_entry *nas_disk_cache_add(void) {
+	if (nas_disk_cache_count >= nas_disk_cache_size) {
+		int size = nas_disk_cache_size ? nas_disk_cache_size * 2 : 8;
+		struct nas_disk_cache_entry *p = realloc(nas_disk_cache, sizeof(*p) * size);
+		if (p == NULL)
+			return NULL;
+		nas_disk_cache = p;
+		nas_disk_cache_size = size;
+	}
+	return nas_disk_cache + nas_disk_cache_count++;
+}
+
+static void nas_disk_cache_load(void) {
+	char line[256];
+	struct nas_disk_cache_entry entry, *p;
+
+	FILE *fp = fopen(disk_cache_file, "r");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (line[0] == '#')
+			continue;
+
+		memset(&entry, 0, sizeof(entry));
+		if (sscanf(line, "%127s %x %hu %hhu %63[^\n]", entry.key, &entry.caps,
+			   &entry.nmrr, &entry.attr_id, entry.model) != 5)
+			continue;
+
+		if ((p = nas_disk_cache_add()) == NULL)
+			break;
+		*p = entry;
+	}
+	fclose(fp);
+
+	syslog(LOG_INFO, "load %d disk(s) from cache %s", nas_disk_cache_count, disk_cache_file);
+}
+
+static struct nas_disk_cache_entry *nas_disk_cache_find(const char *key) {
+	for (int i = 0; i < nas_disk_cache_count; i++) {
+		if (strcmp(nas_disk_cache[i].key, key) == 0)
+			return nas_disk_cache + i;
+	}
+	return NULL;
+}
+
+/*
+ * merge the drives in the list into the loaded entries, a drive missing
+ * now (spun down before it was probed, pulled for a while) keeps its line
+ */
+static void nas_disk_cache_save(void) {
+	char tmp_file[strlen(disk_cache_file) + 5];
+
+	for (int i = 0; i < nas_disk_count; i++) {
+		const struct nas_disk_info *p = nas_disk_list + i;
+		struct nas_disk_cache_entry *entry;
+
+		if ((p->key == NULL) || (p->model == NULL))
+			continue;
+		if (((entry = nas_disk_cache_find(p->key)) == NULL) && ((entry = nas_disk_cache_add()) == NULL))
+			break;
+		snprintf(entry->key, sizeof(entry->key), "%s", p->key);
+		snprintf(entry->model, sizeof(entry->model), "%s", p->model);
+		entry->caps = p->caps;
+		entry->nmrr = p->nmrr;
+		entry->attr_id = p->attr_id;
+	}
+
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", disk_cache_file);
+	FILE *fp = fopen(tmp_file, "w");
+	if (fp == NULL) {
+		syslog(LOG_WARNING, "can not write disk cache %s", tmp_file);
+		nas_log_error();
+		return;
+	}
+
+	fprintf(fp, "# key caps nmrr attr_id model\n");
+	for (int i = 0; i < nas_disk_cache_count; i++) {
+		const struct nas_disk_cache_entry *entry = nas_disk_cache + i;
+		fprintf(fp, "%s %x %hu %hhu %s\n", entry->key, entry->caps, entry->nmrr, entry->attr_id, entry->model);
+	}
+
+	if ((fclose(fp) != 0) || (rename(tmp_file, disk_cache_file) != 0)) {
+		syslog(LOG_WARNING, "failed to save disk cache %s", disk_cache_file);
+		nas_log_error();
+		unlink(tmp_file);
+	}
+}
+
+/* WWN (naa.*) or vendor/model/serial (t10.*) designator exported by the kernel */
+static char *nas_disk_get_key(const char *dev) {
+	char path[strlen(dev) + 24];
+	char buf[128];
+	int len;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/device/wwid", dev);
+	if ((len = nas_read_file(path, buf, sizeof(buf) - 1)) <= 0)
+		return NULL;
+
+	while ((len > 0) && ((buf[len - 1] == '\n') || (buf[len - 1] == ' ')))
+		len--;
+	buf[len] = '\0';
+
+	for (int i = 0; i < len; i++) {
+		if (buf[i] == ' ')
+			buf[i] = '_';
+	}
+
+	return len > 0 ? strdup(buf) : NULL;
+}
+
 void nas_disk_free(void) {
 	if (nas_disk_list != NULL) {
 		for (int i = 0; i < nas_disk_count; i++) {
 			if (nas_disk_list[i].fd >= 0)
 				nas_safe_close(nas_disk_list[i].fd);
 
+			if (nas_disk_list[i].hwmon_fd >= 0)
+				nas_safe_close(nas_disk_list[i].hwmon_fd);
+
+			if (nas_disk_list[i].stat_fd >= 0)
+				nas_safe_close(nas_disk_list[i].stat_fd);
+
+			if (nas_disk_list[i].inflight_fd >= 0)
+				nas_safe_close(nas_disk_list[i].inflight_fd);
+
 			if (nas_disk_list[i].name != NULL)
 				free((void *)nas_disk_list[i].name);
 
 			if (nas_disk_list[i].model != NULL)
 				free((void *)nas_disk_list[i].model);
+
+			if (nas_disk_list[i].key != NULL)
+				free((void *)nas_disk_list[i].key);
 		}
 		free(nas_disk_list);
 	}
+	if (nas_disk_cache != NULL)
+		free(nas_disk_cache);
 }
 
 static int nas_sata_filter(const struct dirent *ent) {
@@ -346,100 +750,826 @@ static int nas_sata_filter(const struct dirent *ent) {
 	       (ent->d_name[3] == '\0') ? 1 : 0;
 }
 
+/* open temp1_input of the drivetemp hwmon node bound to the disk */
+static int nas_disk_hwmon_open(const char *dev) {
+	char path[PATH_MAX];
+	char disk_dev[PATH_MAX];
+	char hwmon_dev[PATH_MAX];
+	char buf[16];
+	struct dirent *ent;
+	int fd = -1;
+
+	snprintf(path, sizeof(path), "/sys/block/%s/device", dev);
+	if (realpath(path, disk_dev) == NULL)
+		return -1;
+
+	DIR *dir = opendir("/sys/class/hwmon");
+	if (dir == NULL)
+		return -1;
+
+	while ((fd < 0) && ((ent = readdir(dir)) != NULL)) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/name", ent->d_name);
+		int name_fd = open(path, O_RDONLY);
+		if (name_fd < 0)
+			continue;
+		ssize_t len = read(name_fd, buf, sizeof(buf) - 1);
+		nas_safe_close(name_fd);
+		if ((len <= 0) || (strncmp(buf, "drivetemp\n", len) != 0))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/device", ent->d_name);
+		if ((realpath(path, hwmon_dev) == NULL) || (strcmp(hwmon_dev, disk_dev) != 0))
+			continue;
+
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s/temp1_input", ent->d_name);
+		fd = open(path, O_RDONLY);
+	}
+	closedir(dir);
+
+	return fd;
+}
+
+/* keep the last good temperature if the read fails */
+static int nas_disk_read_temp(struct nas_disk_info *p) {
+	long value;
+	char temp = 0;
+
+	switch (p->temp_src) {
+		case NAS_DISK_TEMP_HWMON:
+			if (nas_pread_long(p->hwmon_fd, &value) == 0)
+				temp = (char)((value + 500) / 1000);
+			break;
+		case NAS_DISK_TEMP_SCT:
+			temp = sata_get_sct_temperature(p->fd, p->temp_range);
+			break;
+		case NAS_DISK_TEMP_SCSI:
+			temp = scsi_get_temperature(p->fd, p->caps, p->ie);
+			break;
+		default:
+			break;
+	}
+
+	if ((temp <= 0) && (p->attr_id != 0))
+		temp = sata_get_temperature(p->fd, p->attr_id);
+
+	if (temp <= 0)
+		return -1;
+
+	/* keep the last temperature on a bogus reading, it would mislead the fans */
+	if (nas_stats_add(&(p->temp_stats), temp) & NAS_STATS_OUTLIER) {
+		syslog(LOG_NOTICE, "%s: reject temperature %dC, median %.0fC", p->name, temp,
+		       nas_stats_median(&(p->temp_stats)));
+		return 0;
+	}
+
+	p->temp = temp;
+	return 0;
+}
+
+/*
+ * SCSI disks use LOG SENSE, ATA disks prefer drivetemp, then SCT status,
+ * then the vendor SMART attribute
+ */
+static void nas_disk_select_source(struct nas_disk_info *p) {
+	memset(p->temp_range, SCT_TEMP_INVALID, sizeof(p->temp_range));
+
+	if (p->caps & (NAS_DISK_CAP_LP_TEMP | NAS_DISK_CAP_LP_IE))
+		p->temp_src = NAS_DISK_TEMP_SCSI;
+	else if (p->hwmon_fd >= 0)
+		p->temp_src = NAS_DISK_TEMP_HWMON;
+	else if ((p->caps & (NAS_DISK_CAP_SCT | NAS_DISK_CAP_SMART)) ==
+		 (NAS_DISK_CAP_SCT | NAS_DISK_CAP_SMART))
+		p->temp_src = NAS_DISK_TEMP_SCT;
+	else
+		p->temp_src = NAS_DISK_TEMP_SMART;
+}
+
+/* -1 if the drive has no S.M.A.R.T., -2 if it may answer later */
+static int nas_disk_enable_smart(const struct nas_disk_info *p) {
+	if (sata_enable_smart(p->fd) == 0)
+		return 0;
+
+	if (errno != EIO) {
+		syslog(LOG_WARNING, "%s: enable S.M.A.R.T. failed, retry later", p->name);
+		nas_log_error();
+		return -2;
+	}
+
+	syslog(LOG_INFO, "%s: S.M.A.R.T. not available, skip", p->name);
+	return -1;
+}
+
+/* SAS and other SCSI disks, monitored through log pages */
+static int nas_disk_probe_scsi(struct nas_disk_info *p) {
+	char buf[64];
+
+	if (scsi_probe(p->fd, buf, sizeof(buf), &p->caps) != 1) {
+		syslog(LOG_INFO, "skip non-SMART device: %s", p->name);
+		return -1;
+	}
+
+	p->model = strdup(buf);
+	p->nmrr = scsi_rotation_rate(p->fd);
+	nas_disk_select_source(p);
+	if (nas_disk_read_temp(p) != 0) {
+		syslog(LOG_WARNING, "%s: can not read temperature", p->name);
+		return -1;
+	}
+
+	nas_disk_cache_dirty = 1;
+	return 0;
+}
+
+/*
+ * full probe for drives missing from the identity cache, -1 if the device
+ * can not be monitored, -2 if the probe should be retried
+ */
+static int nas_disk_probe(struct nas_disk_info *p) {
+#ifndef NDEBUG
+	syslog(LOG_DEBUG, "probe disk device: %s", p->name);
+#endif
+	if (sata_probe(p->fd) != 1)
+		return nas_disk_probe_scsi(p);
+	p->caps |= NAS_DISK_CAP_SAT;
+
+	char buf[64];
+	p->nmrr = sata_model(p->fd, buf, sizeof(buf), &p->caps);
+	p->model = strdup(buf);
+#ifndef NDEBUG
+	syslog(LOG_DEBUG, "found device: %s %s, rotation rate: %d", p->name, buf, p->nmrr);
+#endif
+
+	int rc = nas_disk_enable_smart(p);
+	if (rc != 0)
+		return rc;
+	p->caps |= NAS_DISK_CAP_SMART;
+
+	nas_disk_select_source(p);
+	if (p->temp_src == NAS_DISK_TEMP_SCT) {
+		if (nas_disk_read_temp(p) == 0) {
+			nas_disk_cache_dirty = 1;
+			return 0;
+		}
+
+		syslog(LOG_INFO, "%s: SCT status unusable, fall back to attributes", p->name);
+		p->caps &= ~NAS_DISK_CAP_SCT;
+		p->temp_src = NAS_DISK_TEMP_SMART;
+	}
+
+	for (int j = 0; j < sizeof(temp_attr_ids) / sizeof(temp_attr_ids[0]); j++) {
+		p->temp = sata_get_temperature(p->fd, temp_attr_ids[j]);
+		if (p->temp > 0) {
+			p->attr_id = temp_attr_ids[j];
+			nas_disk_cache_dirty = 1;
+			return 0;
+		}
+	}
+
+	/* drivetemp still reports the temperature, SMART attributes are optional */
+	if ((p->temp_src == NAS_DISK_TEMP_HWMON) && (nas_disk_read_temp(p) == 0)) {
+		nas_disk_cache_dirty = 1;
+		return 0;
+	}
+
+	syslog(LOG_WARNING, "%s: can not read temperature", p->name);
+	return -1;
+}
+
+static time_t nas_disk_idle_window(const char *dev) {
+	time_t window = 0;
+
+	if (disk_spindown_list == NULL)
+		return 0;
+
+	char list[strlen(disk_spindown_list) + 1];
+	char *save = NULL;
+
+	strcpy(list, disk_spindown_list);
+	for (char *tok = strtok_r(list, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		char *sep = strchr(tok, ':');
+		if (sep == NULL)
+			continue;
+
+		*sep = '\0';
+		if (strcmp(tok, dev) == 0)
+			return strtol(sep + 1, NULL, 10);
+		if (strcmp(tok, "*") == 0)
+			window = strtol(sep + 1, NULL, 10);
+	}
+
+	return window;
+}
+
+/* a disk name pattern matches the device name without /dev/ */
+static int nas_disk_match(const char *pattern, const struct nas_disk_info *p) {
+	return fnmatch(pattern, nas_get_filename(p->name), 0) == 0;
+}
+
+/* in the main thread, the RAID members are not stable while the probe workers run */
+static void nas_disk_peer_group(struct nas_disk_info *p) {
+	int k = 0;
+	for (int sec = nas_conf_next("disk_peers", -1); sec >= 0; sec = nas_conf_next("disk_peers", sec), k++) {
+		const char *disks = nas_conf_get(sec, "disks");
+		if ((disks != NULL) && nas_disk_match(disks, p)) {
+			p->peer.group = k + 2;
+			p->peer.group_name = nas_conf_get(sec, "name") != NULL ? nas_conf_get(sec, "name") : disks;
+			return;
+		}
+	}
+
+	int md = nas_raid_member_of(nas_get_filename(p->name));
+	if (md >= 0) {
+		p->peer.group = -1 - md;
+		p->peer.group_name = nas_raid_name(md);
+		return;
+	}
+
+	p->peer.group = p->nmrr == 0x1;
+	p->peer.group_name = p->nmrr == 0x1 ? "ssd" : "hdd";
+}
+
+static void nas_disk_peer_init(struct nas_disk_info *p) {
+	memset(&(p->peer), 0, sizeof(p->peer));
+	nas_disk_peer_group(p);
+}
+
+/* an md array was assembled or stopped: its disks now compare with each other, or no longer */
+static void nas_disk_peer_regroup(void) {
+	static unsigned long generation = 0;
+
+	if (nas_raid_generation() == generation)
+		return;
+	generation = nas_raid_generation();
+
+	for (int i = 0; i < nas_disk_count; i++) {
+		struct nas_disk_info *p = nas_disk_list + i;
+		int group = p->peer.group;
+
+		nas_disk_peer_group(p);
+		if (p->peer.group != group) {
+			p->peer.peers = 0;
+			p->peer.confirm = 0;
+			syslog(LOG_INFO, "%s: compared with its %s peers", p->name, p->peer.group_name);
+		}
+	}
+}
+
+/* the block layer statistics are kept open for the I/O load and the idle detection */
+static void nas_disk_io_init(struct nas_disk_info *p, const char *dev) {
+	char path[strlen(dev) + 24];
+
+	memset(&(p->io), 0, sizeof(p->io));
+
+	snprintf(path, sizeof(path), "/sys/block/%s/stat", dev);
+	if ((p->stat_fd = open(path, O_RDONLY)) < 0)
+		syslog(LOG_WARNING, "%s: no I/O statistics: %d", p->name, errno);
+
+	snprintf(path, sizeof(path), "/sys/block/%s/inflight", dev);
+	p->inflight_fd = open(path, O_RDONLY);
+}
+
+/* only rotating ATA disks are spun down */
+static void nas_disk_idle_init(struct nas_disk_info *p, const char *dev) {
+	p->idle_window = 0;
+	p->idle_scale = 1;
+	if (!(p->caps & NAS_DISK_CAP_SAT) || (p->nmrr == 0x1))
+		return;
+
+	p->idle_window = nas_disk_idle_window(dev);
+	if (p->idle_window <= 0)
+		return;
+
+	if (p->stat_fd < 0) {
+		syslog(LOG_WARNING, "%s: no I/O statistics, spin down disabled", p->name);
+		p->idle_window = 0;
+		return;
+	}
+
+	syslog(LOG_INFO, "%s: spin down after %lds idle", p->name, (long)p->idle_window);
+}
+
+/* identify the drive through the cache, or probe it */
+static int nas_disk_setup(struct nas_disk_info *p, const char *dev) {
+	const struct nas_disk_cache_entry *entry;
+
+	/* a SMART read off by more than 10C from the last ones is rejected, 6C off the baseline is a drift */
+	nas_stats_init(&(p->temp_stats), 10, 0, 6, 0);
+
+	p->hwmon_fd = nas_disk_hwmon_open(dev);
+	nas_disk_select_source(p);
+
+	p->key = nas_disk_get_key(dev);
+	entry = p->key != NULL ? nas_disk_cache_find(p->key) : NULL;
+	if (entry != NULL) {
+		p->model = strdup(entry->model);
+		p->caps = entry->caps;
+		p->nmrr = entry->nmrr;
+		p->attr_id = entry->attr_id;
+		nas_disk_select_source(p);
+		nas_disk_read_temp(p);
+	} else {
+		int rc = nas_disk_probe(p);
+		if (rc != 0)
+			return rc;
+	}
+
+	syslog(LOG_INFO, "%s: %s, temperature %dC (%s, R%d)%s", p->name, p->model, p->temp,
+	       nas_disk_temp_source_names[p->temp_src], p->attr_id, entry != NULL ? ", cached" : "");
+
+	nas_disk_io_init(p, dev);
+	nas_disk_idle_init(p, dev);
+	return 0;
+}
+
+/* forget everything learned about the drive, but keep its name */
+static void nas_disk_reset(struct nas_disk_info *p) {
+	if (p->fd >= 0)
+		nas_safe_close(p->fd);
+	if (p->hwmon_fd >= 0)
+		nas_safe_close(p->hwmon_fd);
+	if (p->stat_fd >= 0)
+		nas_safe_close(p->stat_fd);
+	if (p->inflight_fd >= 0)
+		nas_safe_close(p->inflight_fd);
+	free((void *)p->model);
+	free((void *)p->key);
+
+	p->fd = -1;
+	p->hwmon_fd = -1;
+	p->stat_fd = -1;
+	p->inflight_fd = -1;
+	p->standby = 0;
+	p->model = NULL;
+	p->key = NULL;
+	p->caps = 0;
+	p->attr_id = 0;
+	p->temp = 0;
+	p->nmrr = 0;
+	memset(p->ie, 0, sizeof(p->ie));
+}
+
+static void nas_disk_set_state(struct nas_disk_info *p, const enum nas_disk_state state) {
+	if (p->state != state) {
+		syslog(state == NAS_DISK_HEALTHY ? LOG_NOTICE : LOG_WARNING, "%s: state %s -> %s",
+		       p->name, nas_disk_state_names[p->state], nas_disk_state_names[state]);
+		p->state = state;
+	}
+}
+
+static void nas_disk_backoff(struct nas_disk_info *p, const time_t now) {
+	p->backoff = p->backoff > 0 ? p->backoff * 2 : smart_update_interval;
+	if (p->backoff > disk_backoff_max)
+		p->backoff = disk_backoff_max;
+	p->retry_ts = now + p->backoff;
+}
+
+static void nas_disk_read_failed(struct nas_disk_info *p, const time_t now) {
+	char path[strlen(p->name) + 16];
+
+	snprintf(path, sizeof(path), "/sys/block/%s", nas_get_filename(p->name));
+	if (access(path, F_OK) != 0) {
+		nas_disk_reset(p);
+		nas_disk_set_state(p, NAS_DISK_REMOVED);
+		nas_disk_backoff(p, now);
+		return;
+	}
+
+	if (++p->failures < disk_failures_max) {
+		nas_disk_set_state(p, NAS_DISK_DEGRADED);
+		return;
+	}
+
+	nas_disk_set_state(p, NAS_DISK_FAILED);
+	nas_disk_backoff(p, now);
+}
+
+/* startup probing runs in a small pool of workers, one slot per candidate */
+struct nas_disk_probe_slot {
+	struct nas_disk_info disk;
+	int rc;
+	int done;
+	int collected;
+};
+
+int disk_probe_workers = 4;
+
+static struct nas_disk_probe_slot *nas_disk_probe_slots = NULL;
+static int nas_disk_probe_count = 0;
+static int nas_disk_probe_next = 0;
+static int nas_disk_probe_pending = 0;
+static pthread_t *nas_disk_probe_threads = NULL;
+static int nas_disk_probe_thread_count = 0;
+static pthread_mutex_t nas_disk_probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec nas_disk_probe_ts;
+
+/* reopen a removed drive, re-identify one that never finished probing */
+static int nas_disk_recover(struct nas_disk_info *p, const time_t now) {
+	if ((p->fd >= 0) && (p->model != NULL))
+		return 0;
+
+	nas_disk_reset(p);
+	if (((p->fd = open(p->name, O_RDONLY)) < 0) ||
+	    (nas_disk_setup(p, nas_get_filename(p->name)) != 0)) {
+		nas_disk_backoff(p, now);
+		return -1;
+	}
+	nas_disk_peer_init(p);
+
+	/* the probe workers still look up the cache, the last collect saves it */
+	if ((nas_disk_probe_slots == NULL) && atomic_exchange(&nas_disk_cache_dirty, 0))
+		nas_disk_cache_save();
+	return 0;
+}
+
+static void *nas_disk_probe_worker(void *arg) {
+	struct timespec ts;
+
+	while (1) {
+		pthread_mutex_lock(&nas_disk_probe_lock);
+		int i = nas_disk_probe_next < nas_disk_probe_count ? nas_disk_probe_next++ : -1;
+		pthread_mutex_unlock(&nas_disk_probe_lock);
+		if (i < 0)
+			break;
+
+		struct nas_disk_info *p = &nas_disk_probe_slots[i].disk;
+		int rc;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		if ((p->fd = open(p->name, O_RDONLY)) < 0) {
+			syslog(LOG_ERR, "skip open failed disk device file: %s", p->name);
+			rc = -1;
+		} else
+			rc = nas_disk_setup(p, nas_get_filename(p->name));
+#ifndef NDEBUG
+		syslog(LOG_DEBUG, "%s: probe finished in %ld ms", p->name, nas_elapsed_ms(&ts));
+#endif
+
+		pthread_mutex_lock(&nas_disk_probe_lock);
+		nas_disk_probe_slots[i].rc = rc;
+		nas_disk_probe_slots[i].done = 1;
+		pthread_mutex_unlock(&nas_disk_probe_lock);
+	}
+
+	return NULL;
+}
+
+static void nas_disk_probe_join(void) {
+	for (int i = 0; i < nas_disk_probe_thread_count; i++)
+		pthread_join(nas_disk_probe_threads[i], NULL);
+
+	free(nas_disk_probe_threads);
+	nas_disk_probe_threads = NULL;
+	nas_disk_probe_thread_count = 0;
+}
+
+void nas_disk_probe_free(void) {
+	if (nas_disk_probe_slots == NULL)
+		return;
+
+	nas_disk_probe_join();
+	for (int i = 0; i < nas_disk_probe_count; i++) {
+		if (!nas_disk_probe_slots[i].collected) {
+			nas_disk_reset(&nas_disk_probe_slots[i].disk);
+			free((void *)nas_disk_probe_slots[i].disk.name);
+		}
+	}
+	free(nas_disk_probe_slots);
+	nas_disk_probe_slots = NULL;
+}
+
+/* move finished probes into nas_disk_list, keeping device name order */
+static void nas_disk_collect(void) {
+	if (nas_disk_probe_slots == NULL)
+		return;
+
+	pthread_mutex_lock(&nas_disk_probe_lock);
+	for (int i = 0; i < nas_disk_probe_count; i++) {
+		struct nas_disk_probe_slot *slot = nas_disk_probe_slots + i;
+		struct nas_disk_info *p = &slot->disk;
+
+		if (!slot->done || slot->collected)
+			continue;
+
+		slot->collected = 1;
+		nas_disk_probe_pending--;
+
+		if (slot->rc == -2) {
+			/* keep the slot, nas_disk_update() retries it */
+			nas_disk_reset(p);
+			p->state = NAS_DISK_FAILED;
+		} else if (slot->rc != 0) {
+			nas_disk_reset(p);
+			free((void *)p->name);
+			continue;
+		}
+
+		int j = nas_disk_count;
+		while ((j > 0) && (strcmp(nas_disk_list[j - 1].name, p->name) > 0)) {
+			nas_disk_list[j] = nas_disk_list[j - 1];
+			j--;
+		}
+		nas_disk_list[j] = *p;
+		nas_disk_peer_init(nas_disk_list + j);
+		nas_disk_count++;
+
+		/* join the fan control before the next poll */
+		if (p->state == NAS_DISK_HEALTHY) {
+			if ((p->nmrr != 0x1) && (p->temp > hdd_temp))
+				hdd_temp = p->temp;
+			else if ((p->nmrr == 0x1) && (p->temp > ssd_temp))
+				ssd_temp = p->temp;
+		}
+	}
+	pthread_mutex_unlock(&nas_disk_probe_lock);
+
+	if (nas_disk_probe_pending > 0)
+		return;
+
+	nas_disk_probe_free();
+
+	if (atomic_exchange(&nas_disk_cache_dirty, 0))
+		nas_disk_cache_save();
+
+	syslog(LOG_INFO, "disk probe finished, %d disk(s) in %ld ms", nas_disk_count,
+	       nas_elapsed_ms(&nas_disk_probe_ts));
+}
+
 void nas_disk_init(void) {
 	struct dirent **namelist;
 	int count;
 
+	clock_gettime(CLOCK_MONOTONIC, &nas_disk_probe_ts);
+
 	count = scandir("/dev", &namelist, nas_sata_filter, alphasort);
 	if (count < 0) {
 		syslog(LOG_ERR, "failed to open device dir to scan disk");
 		exit(EXIT_FAILURE);
 	}
 
-	if ((nas_disk_list = calloc(sizeof(*nas_disk_list), (size_t)count)) == NULL) {
+	if (((nas_disk_list = calloc(sizeof(*nas_disk_list), (size_t)count)) == NULL) ||
+	    ((nas_disk_probe_slots = calloc(sizeof(*nas_disk_probe_slots), (size_t)count)) == NULL)) {
 		syslog(LOG_ERR, "failed to allocate memory for disk list");
 		exit(EXIT_FAILURE);
 	}
 
+	nas_disk_cache_load();
+	atexit(nas_disk_free);
+	atexit(nas_disk_probe_free);
+
 	nas_disk_count = 0;
 	for (int i = 0; i < count; free(namelist[i++])) {
+		struct nas_disk_info *p = &nas_disk_probe_slots[i].disk;
 		char name[strlen(namelist[i]->d_name) + 6];
 
 		strcpy(name, "/dev/");
 		strcpy(name + 5, namelist[i]->d_name);
 
-		if ((nas_disk_list[i].fd = open(name, O_RDONLY)) < 0) {
-			syslog(LOG_ERR, "skip open failed disk device file: %s", name);
-			continue;
-		}
-
-#ifndef NDEBUG
-		syslog(LOG_DEBUG, "probe disk device: %s", name);
-#endif
-		if (sata_probe(nas_disk_list[i].fd) != 1) {
-			syslog(LOG_INFO, "skip non-SMART device: %s", name);
-			nas_safe_close(nas_disk_list[i].fd);
-			continue;
-		}
-
-		if ((nas_disk_list[i].name = strdup(name)) == NULL) {
+		p->fd = -1;
+		p->hwmon_fd = -1;
+		p->stat_fd = -1;
+		p->inflight_fd = -1;
+		if ((p->name = strdup(name)) == NULL) {
 			syslog(LOG_ERR, "failed to save disk name");
 			exit(EXIT_FAILURE);
 		}
+	}
+	free(namelist);
 
-		char buf[1024];
-		nas_disk_list[i].nmrr = sata_model(nas_disk_list[i].fd, buf, sizeof(buf));
-		nas_disk_list[i].model = strdup(buf);
-#ifndef NDEBUG
-		syslog(LOG_DEBUG, "found device: %s %s, rotation rate: %d", name, buf, nas_disk_list[i].nmrr);
-#endif
+	nas_disk_probe_count = count;
+	nas_disk_probe_pending = count;
 
-		/* enable SMART */
-		if (sata_enable_smart(nas_disk_list[i].fd) != 0) {
-			if (errno == EIO) {
-				syslog(LOG_INFO, "%s: S.M.A.R.T. not available, skip", name);
-				nas_safe_close(nas_disk_list[i].fd);
-				continue;
-			} else {
-				/* sleep a moment and try again */
-				sleep(3);
-				if (sata_enable_smart(nas_disk_list[i].fd) != 0) {
-					if (errno == EIO) {
-						syslog(LOG_INFO, "%s: S.M.A.R.T. not available, skip", name);
-						nas_safe_close(nas_disk_list[i].fd);
-						continue;
-					} else {
-						nas_log_error();
-						exit(EXIT_FAILURE);
-					}
-				}
-			}
+	int workers = count < disk_probe_workers ? count : disk_probe_workers;
+	if ((workers > 0) && ((nas_disk_probe_threads = calloc(sizeof(pthread_t), (size_t)workers)) == NULL)) {
+		syslog(LOG_ERR, "failed to allocate memory for disk probe");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < workers; i++) {
+		if (pthread_create(nas_disk_probe_threads + i, NULL, nas_disk_probe_worker, NULL) != 0) {
+			syslog(LOG_WARNING, "failed to start disk probe worker %d", i);
+			break;
 		}
+		nas_disk_probe_thread_count++;
+	}
+
+	/* probe in the caller if no worker could be started */
+	if (nas_disk_probe_thread_count == 0)
+		nas_disk_probe_worker(NULL);
 
-		int j = 0;
-		for (; j < sizeof(temp_attr_ids) / sizeof(temp_attr_ids[0]); j++) {
-			nas_disk_list[i].temp = sata_get_temperature(nas_disk_list[i].fd, temp_attr_ids[j]);
+	syslog(LOG_INFO, "probe %d disk device(s) with %d worker(s)", count, nas_disk_probe_thread_count);
+	syslog(LOG_INFO, "Hard disk guard temperature: %d -> %d", hdd_temp_notice, hdd_temp_halt);
+	syslog(LOG_INFO, "SSD guard temperature: %d -> %d", ssd_temp_notice, ssd_temp_halt);
 
-			if (nas_disk_list[i].temp > 0) {
-				syslog(LOG_INFO, "%s: %s, temperature %dC (R%d)", nas_disk_list[i].name,
-				       nas_disk_list[i].model, nas_disk_list[i].temp, temp_attr_ids[j]);
-				nas_disk_list[i].attr_id = temp_attr_ids[j];
-				nas_disk_count++;
-				break;
+	nas_disk_collect();
+}
+
+static int ata_standby(const int fd) {
+	unsigned char args[4] = {WIN_STANDBYNOW1, 0, 0, 0};
+	return ioctl(fd, HDIO_DRIVE_CMD, &args);
+}
+
+/*
+ * spin down a disk once it saw no completed I/O for its idle window. A
+ * disk above the notice temperature is spun down after half the window,
+ * a disk that spins up again within the window gets a longer one.
+ */
+static int nas_disk_idle_check(struct nas_disk_info *p, const time_t now) {
+	if ((p->idle_window <= 0) || (p->state != NAS_DISK_HEALTHY) || (p->io.samples == 0))
+		return 0;
+
+	/* reads and writes completed, as of the last nas_disk_io_sample() */
+	unsigned long ios = p->io.stat[NAS_DISK_STAT_READ_IOS] + p->io.stat[NAS_DISK_STAT_WRITE_IOS];
+	if ((ios != p->ios) || (p->io_ts == 0)) {
+		p->ios = ios;
+		p->io_ts = now;
+
+		if (p->standby) {
+			p->standby = 0;
+			p->spinups++;
+			nas_stats_restart(&(p->temp_stats));
+			if (now - p->standby_ts < p->idle_window * p->idle_scale) {
+				if (p->idle_scale < disk_idle_scale_max)
+					p->idle_scale *= 2;
+				p->thrash_ts = now;
+				syslog(LOG_NOTICE, "%s: spun up after %lds, idle window now %lds", p->name,
+				       (long)(now - p->standby_ts), (long)(p->idle_window * p->idle_scale));
 			}
 		}
+		return 0;
+	}
 
-		nas_safe_close(nas_disk_list[i].fd);
+	if ((p->idle_scale > 1) && (now - p->thrash_ts > disk_idle_scale_reset))
+		p->idle_scale = 1;
 
-		if (j >= sizeof(temp_attr_ids) / sizeof(temp_attr_ids[0]))
-			syslog(LOG_WARNING, "%s: can not read temperature", name);
+	time_t window = p->idle_window * p->idle_scale;
+	if (p->temp >= hdd_temp_notice)
+		window /= 2;
+
+	if (p->standby || (now - p->io_ts < window))
+		return 0;
+
+	enum e_powermode mode = ata_get_powermode(p->fd);
+	if ((mode == PWM_STANDBY) || (mode == PWM_SLEEPING)) {
+		p->standby = 1;
+		p->standby_ts = now;
+		nas_stats_restart(&(p->temp_stats));
+		return 0;
 	}
 
-	free(namelist);
-	atexit(nas_disk_free);
+	if (ata_standby(p->fd) != 0) {
+		syslog(LOG_WARNING, "%s: standby command failed", p->name);
+		nas_log_error();
+		return 0;
+	}
 
-	syslog(LOG_INFO, "Hard disk guard temperature: %d -> %d", hdd_temp_notice, hdd_temp_halt);
-	syslog(LOG_INFO, "SSD guard temperature: %d -> %d", ssd_temp_notice, ssd_temp_halt);
+	syslog(LOG_INFO, "%s: idle for %lds, spin down", p->name, (long)(now - p->io_ts));
+	p->standby = 1;
+	p->standby_ts = now;
+	p->temp = 0;
+	/* it cools down meanwhile, the first reading after the spin-up is no outlier */
+	nas_stats_restart(&(p->temp_stats));
+	return 1;
+}
+
+/* first index of the sorted window not below x */
+static int nas_disk_peer_search(const double *sorted, const int n, const double x) {
+	int lo = 0, hi = n;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (sorted[mid] < x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* O(window) instead of a sort per sample: drop the oldest value, insert the new one in place */
+static void nas_disk_peer_add(struct nas_disk_peer *w, const double x) {
+	int n = w->filled;
+	int k;
+
+	if (n == DISK_PEER_WINDOW) {
+		k = nas_disk_peer_search(w->sorted, n, w->window[w->pos]);
+		memmove(w->sorted + k, w->sorted + k + 1, (n - k - 1) * sizeof(*w->sorted));
+		n--;
+	} else
+		w->filled++;
+
+	w->window[w->pos] = x;
+	w->pos = (w->pos + 1) % DISK_PEER_WINDOW;
+
+	k = nas_disk_peer_search(w->sorted, n, x);
+	memmove(w->sorted + k + 1, w->sorted + k, (n - k) * sizeof(*w->sorted));
+	w->sorted[k] = x;
+	w->fresh = 1;
+}
+
+static double nas_disk_peer_percentile(const struct nas_disk_peer *w, const double q) {
+	return w->filled > 0 ? w->sorted[(int)(q * (w->filled - 1) + 0.5)] : 0;
+}
+
+/* read the block layer counters, on every tick; a spun down disk is not woken by it */
+static void nas_disk_io_sample(struct nas_disk_info *p) {
+	struct nas_disk_io *io = &(p->io);
+	unsigned long stat[NAS_DISK_STAT_FIELDS];
+
+	if ((p->stat_fd < 0) ||
+	    (nas_pread_ulongs(p->stat_fd, stat, NAS_DISK_STAT_FIELDS) != NAS_DISK_STAT_FIELDS))
+		return;
+	if (p->inflight_fd >= 0)
+		nas_pread_ulongs(p->inflight_fd, io->inflight, 2);
+
+	double dt = io->samples > 0 ? nas_elapsed_ms(&(io->ts)) / 1000.0 : 0;
+	clock_gettime(CLOCK_MONOTONIC, &(io->ts));
+
+	if (dt > 0) {
+		unsigned long rd = stat[NAS_DISK_STAT_READ_IOS] - io->stat[NAS_DISK_STAT_READ_IOS];
+		unsigned long wr = stat[NAS_DISK_STAT_WRITE_IOS] - io->stat[NAS_DISK_STAT_WRITE_IOS];
+		unsigned long ticks = stat[NAS_DISK_STAT_READ_TICKS] - io->stat[NAS_DISK_STAT_READ_TICKS] +
+				      stat[NAS_DISK_STAT_WRITE_TICKS] - io->stat[NAS_DISK_STAT_WRITE_TICKS];
+
+		/* sectors are 512 bytes whatever the drive uses */
+		io->read_bps = (double)(stat[NAS_DISK_STAT_READ_SECTORS] - io->stat[NAS_DISK_STAT_READ_SECTORS]) *
+			       512 / dt;
+		io->write_bps = (double)(stat[NAS_DISK_STAT_WRITE_SECTORS] - io->stat[NAS_DISK_STAT_WRITE_SECTORS]) *
+				512 / dt;
+		io->read_iops = (double)rd / dt;
+		io->write_iops = (double)wr / dt;
+		unsigned long busy = stat[NAS_DISK_STAT_IO_TICKS] - io->stat[NAS_DISK_STAT_IO_TICKS];
+
+		io->await = rd + wr > 0 ? (double)ticks / (double)(rd + wr) : 0;
+		io->svctm = rd + wr > 0 ? (double)busy / (double)(rd + wr) : 0;
+		io->util = (double)busy / (dt * 10);
+		if (io->util > 100)
+			io->util = 100;
+
+		if (rd + wr >= disk_peer_min_ios)
+			nas_disk_peer_add(&(p->peer), io->svctm);
+	}
+	memcpy(io->stat, stat, sizeof(stat));
+	io->samples++;
+}
+
+static int nas_disk_cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void nas_disk_peer_check(struct nas_disk_info *p) {
+	struct nas_disk_peer *w = &(p->peer);
+	double peers[nas_disk_count];
+	int n = 0;
+
+	if (!w->fresh)
+		return;
+	w->fresh = 0;
+
+	for (int i = 0; i < nas_disk_count; i++) {
+		const struct nas_disk_info *q = nas_disk_list + i;
+		if ((q != p) && (q->peer.group == w->group) && (q->state == NAS_DISK_HEALTHY) &&
+		    (q->peer.filled >= disk_peer_min_samples))
+			peers[n++] = nas_disk_peer_percentile(&(q->peer), 0.5);
+	}
+
+	w->peers = 0;
+	if ((n >= disk_peer_min_peers) && (w->filled >= disk_peer_min_samples)) {
+		qsort(peers, (size_t)n, sizeof(*peers), nas_disk_cmp_double);
+		w->peers = (n & 1) ? peers[n / 2] : (peers[n / 2 - 1] + peers[n / 2]) / 2;
+	}
+
+	/* nothing to compare with, e.g. a peer failed or spun down: no longer known slow */
+	if (w->peers <= 0) {
+		w->confirm = 0;
+		if (w->slow) {
+			w->slow = 0;
+			syslog(LOG_NOTICE, "%s: too few busy %s peers to compare the service time with", p->name,
+			       w->group_name);
+		}
+		return;
+	}
+
+	double mine = nas_disk_peer_percentile(w, 0.5);
+	int slow = (mine > w->peers * disk_peer_ratio) && (mine > w->peers + disk_peer_margin);
+	if (slow == w->slow) {
+		w->confirm = 0;
+		return;
+	}
+	if (++w->confirm < disk_peer_confirm)
+		return;
+
+	w->slow = slow;
+	w->confirm = 0;
+	if (slow)
+		syslog(LOG_WARNING, "%s: slow disk, service time %.1fms (p90 %.1fms) against %.1fms of its %s peers",
+		       p->name, mine, nas_disk_peer_percentile(w, 0.9), w->peers, w->group_name);
+	else
+		syslog(LOG_NOTICE, "%s: service time %.1fms back in line with its %s peers", p->name, mine,
+		       w->group_name);
 }
 
 int nas_disk_update(time_t now) {
@@ -449,10 +1579,23 @@ int nas_disk_update(time_t now) {
 	bool hdd_bypass;
 	int err = 0;
 
+	nas_disk_collect();
+
+	nas_disk_peer_regroup();
+	for (int i = 0; i < nas_disk_count; i++)
+		nas_disk_io_sample(nas_disk_list + i);
+	for (int i = 0; i < nas_disk_count; i++)
+		nas_disk_peer_check(nas_disk_list + i);
+
 	if (now - last_tick < smart_update_interval)
 		return err;
 
-	if (now - last_hdd_tick < smart_hdd_update_interval)
+	/* a spun down disk no longer heats, re-evaluate hard disks now */
+	int spun_down = 0;
+	for (int i = 0; i < nas_disk_count; i++)
+		spun_down += nas_disk_idle_check(nas_disk_list + i, now);
+
+	if ((spun_down == 0) && (now - last_hdd_tick < smart_hdd_update_interval))
 		hdd_bypass = true;
 	else {
 		hdd_bypass = false;
@@ -462,97 +1605,180 @@ int nas_disk_update(time_t now) {
 	ssd_temp = 0;
 	last_tick = now;
 
+	int fresh_temp[2] = {0, 0};
+	int fresh_disks[2] = {0, 0};
 	for (int i = 0; i < nas_disk_count; i++) {
-		if ((nas_disk_list[i].nmrr != 0x1) && hdd_bypass)
+		struct nas_disk_info *p = nas_disk_list + i;
+
+		if ((p->nmrr != 0x1) && hdd_bypass)
 			continue;
 
-		nas_disk_list[i].fd = open(nas_disk_list[i].name, O_RDONLY);
-		if (nas_disk_list[i].fd < 0) {
-			char buf[256];
-			strerror_r(errno, buf, sizeof(buf));
-			syslog(LOG_ERR, "failed to open disk device file %s: %s", nas_disk_list[i].name, buf);
-			exit(EXIT_FAILURE);
+		if ((p->state == NAS_DISK_FAILED) || (p->state == NAS_DISK_REMOVED)) {
+			if ((now < p->retry_ts) || (nas_disk_recover(p, now) != 0))
+				continue;
 		}
 
-		mode = ata_get_powermode(nas_disk_list[i].fd);
+		mode = (p->caps & NAS_DISK_CAP_SAT) ? ata_get_powermode(p->fd) : PWM_UNKNOWN;
 
-		if ((nas_disk_list[i].nmrr == 0x1) ||
-		    ((mode != PWM_STANDBY) && (mode != PWM_SLEEPING))) {
-			nas_disk_list[i].temp = sata_get_temperature(nas_disk_list[i].fd, nas_disk_list[i].attr_id);
+		if ((p->nmrr == 0x1) || ((mode != PWM_STANDBY) && (mode != PWM_SLEEPING))) {
+			if (nas_disk_read_temp(p) != 0) {
+				nas_disk_read_failed(p, now);
+				if (p->state != NAS_DISK_DEGRADED)
+					continue;
+			} else {
+				p->failures = 0;
+				p->backoff = 0;
+				nas_disk_set_state(p, NAS_DISK_HEALTHY);
+
+				int ssd = p->nmrr == 0x1;
+				if (p->temp > fresh_temp[ssd])
+					fresh_temp[ssd] = p->temp;
+				fresh_disks[ssd]++;
+			}
 #ifndef NDEBUG
-			syslog(LOG_DEBUG, "%s: %s, temperature %dC",
-			       nas_disk_list[i].name, nas_disk_list[i].model, nas_disk_list[i].temp);
+			syslog(LOG_DEBUG, "%s: %s, temperature %dC", p->name, p->model, p->temp);
 #endif
 
-			if (nas_disk_list[i].nmrr != 0x01) {
-				if (nas_disk_list[i].temp > hdd_temp)
-					hdd_temp = nas_disk_list[i].temp;
+			if (p->ie[0] != 0)
+				syslog(LOG_WARNING, "%s: failure prediction, ASC %02X ASCQ %02X",
+				       p->name, p->ie[0], p->ie[1]);
+
+			if (p->nmrr != 0x01) {
+				if (p->temp > hdd_temp)
+					hdd_temp = p->temp;
 
-				if (nas_disk_list[i].temp >= hdd_temp_warn) {
-					syslog(LOG_WARNING, "%s: hard disk high temperature %dC",
-					       nas_disk_list[i].name, nas_disk_list[i].temp);
+				if (p->temp >= hdd_temp_warn) {
+					syslog(LOG_WARNING, "%s: hard disk high temperature %dC", p->name, p->temp);
 
-					if (nas_disk_list[i].temp >= hdd_temp_halt) {
+					if (p->temp >= hdd_temp_halt) {
 						syslog(LOG_ALERT,
 						       "%s: hard disk temperature too high, need to shutdown",
-						       nas_disk_list[i].name);
+						       p->name);
 						err++;
 					}
 				}
 			} else {
-				if (nas_disk_list[i].temp > ssd_temp)
-					ssd_temp = nas_disk_list[i].temp;
+				if (p->temp > ssd_temp)
+					ssd_temp = p->temp;
 
-				if (nas_disk_list[i].temp >= ssd_temp_warn) {
+				if (p->temp >= ssd_temp_warn) {
 					syslog(LOG_WARNING,
-					       "%s: solid state disk high temperature %dC",
-					       nas_disk_list[i].name, nas_disk_list[i].temp);
+					       "%s: solid state disk high temperature %dC", p->name, p->temp);
 
-					if (nas_disk_list[i].temp >= ssd_temp_halt) {
+					if (p->temp >= ssd_temp_halt) {
 						syslog(LOG_ALERT,
 						       "%s: solid state disk temperature too high, need to shutdown",
-						       nas_disk_list[i].name);
+						       p->name);
 						err++;
 					}
 				}
 			}
-		} else
-			nas_disk_list[i].temp = 0;
+		} else {
+			p->temp = 0;
+			nas_stats_restart(&(p->temp_stats));
+		}
+	}
 
-		nas_safe_close(nas_disk_list[i].fd);
+	for (int ssd = hdd_bypass ? 1 : 0; ssd < 2; ssd++) {
+		disk_guard_temp[ssd] = fresh_temp[ssd];
+		disk_guard_disks[ssd] = fresh_disks[ssd];
+		disk_guard_gen[ssd]++;
 	}
 
 	return err;
 }
 
-int nas_disk_get_pwm(void) {
-	int pwm_hdd = (int)(255.0 * (hdd_temp - hdd_temp_notice) / (hdd_temp_halt - hdd_temp_notice));
-	if (pwm_hdd < 0)
-		pwm_hdd = 0;
-	else if (pwm_hdd > 255)
-		pwm_hdd = 255;
+/* hottest disk of a kind, input of the hdd/ssd fan controllers */
+double nas_disk_get_temp(const int ssd) {
+	int temp = ssd ? ssd_temp : hdd_temp;
+	int warn = ssd ? ssd_temp_warn : hdd_temp_warn;
 
-	int pwm_ssd = (int)(255.0 * (ssd_temp - ssd_temp_notice) / (ssd_temp_halt - ssd_temp_notice));
-	if (pwm_ssd < 0)
-		pwm_ssd = 0;
-	else if (pwm_ssd > 255)
-		pwm_ssd = 255;
+	/* no reading from a failed disk, assume it is already warm */
+	for (int i = 0; i < nas_disk_count; i++) {
+		if ((nas_disk_list[i].state == NAS_DISK_FAILED) &&
+		    ((nas_disk_list[i].nmrr == 0x1) == (ssd != 0)) && (temp < warn))
+			temp = warn;
+	}
 
-#ifndef NDEBUG
-	syslog(LOG_DEBUG, "hard disk temp: %d, pwm_hdd output %d; ssd temp %d, pwm_ssd output %d",
-	       hdd_temp, pwm_hdd, ssd_temp, pwm_ssd);
-#endif
+	return temp;
+}
+
+/*
+ * hottest disk of a kind as last read, without the stand-in of failed
+ * disks or the ones in standby; 0 if none. gen changes with every read
+ * pass, disks is the number of disks it covers.
+ */
+double nas_disk_guard_temp(const int ssd, unsigned long *gen, int *disks) {
+	*gen = disk_guard_gen[ssd != 0];
+	*disks = disk_guard_disks[ssd != 0];
+	return disk_guard_temp[ssd != 0];
+}
+
+/* 1 if a member disk of the md array is at its warning temperature, failed or sleeping ones do not count */
+int nas_disk_array_hot(const int md) {
+	for (int i = 0; i < nas_disk_count; i++) {
+		const struct nas_disk_info *p = nas_disk_list + i;
+
+		if ((p->state == NAS_DISK_FAILED) || (p->state == NAS_DISK_REMOVED) || (p->temp <= 0))
+			continue;
+		if ((p->temp >= (p->nmrr == 0x1 ? ssd_temp_warn : hdd_temp_warn)) &&
+		    nas_raid_has_member(md, nas_get_filename(p->name)))
+			return 1;
+	}
+	return 0;
+}
 
-	return pwm_hdd > pwm_ssd ? pwm_hdd : pwm_ssd;
+/* hottest disk with a name matching the pattern, NAN if none */
+double nas_disk_match_temp(const char *pattern) {
+	double temp = NAN;
+
+	for (int i = 0; i < nas_disk_count; i++) {
+		const struct nas_disk_info *p = nas_disk_list + i;
+		int t = p->state == NAS_DISK_FAILED ? (p->nmrr == 0x1 ? ssd_temp_warn : hdd_temp_warn) : p->temp;
+
+		if ((p->state != NAS_DISK_REMOVED) && nas_disk_match(pattern, p) &&
+		    (isnan(temp) || (t > temp)))
+			temp = t;
+	}
+	return temp;
 }
 
 int nas_disk_item_show(const int off) {
 	static int id = -1;
 
-	id = id >= 0 ? (nas_disk_count + id + off) % nas_disk_count : 0;
+	if (nas_disk_count == 0) {
+		lcd_printf(1, "Disk:");
+		lcd_printf(2, "N/A");
+		return id;
+	}
 
-	lcd_printf(1, "%s", nas_disk_list[id].model);
-	lcd_printf(2, "%s: %d C", nas_disk_list[id].name, nas_disk_list[id].temp);
+	/* two pages per disk, the identity and the I/O load */
+	int pages = nas_disk_count * 2;
+	id = id >= 0 ? (pages + id + off) % pages : 0;
+
+	const struct nas_disk_info *p = nas_disk_list + id / 2;
+	if ((id & 1) && p->peer.slow && (p->peer.peers > 0)) {
+		lcd_printf(1, "%s SLOW x%.1f", nas_get_filename(p->name),
+			   nas_disk_peer_percentile(&(p->peer), 0.5) / p->peer.peers);
+		lcd_printf(2, "%.1fms peers %.1f", nas_disk_peer_percentile(&(p->peer), 0.5), p->peer.peers);
+		return id;
+	}
+	if (id & 1) {
+		lcd_printf(1, "%s %.1f/%.1fM", nas_get_filename(p->name), p->io.read_bps / 1e6, p->io.write_bps / 1e6);
+		lcd_printf(2, "%.0fio %.1fms %.0f%%", p->io.read_iops + p->io.write_iops, p->io.await, p->io.util);
+		return id;
+	}
+
+	if (p->ie[0] != 0)
+		lcd_printf(1, "IE %02X/%02X %s", p->ie[0], p->ie[1], p->model);
+	else
+		lcd_printf(1, "%s", p->model != NULL ? p->model : "unknown");
+	if ((p->state == NAS_DISK_HEALTHY) && p->peer.slow)
+		lcd_printf(2, "%s: %d C slow", p->name, p->temp);
+	else if (p->state == NAS_DISK_HEALTHY)
+		lcd_printf(2, "%s: %d C", p->name, p->temp);
+	else
+		lcd_printf(2, "%s: %s", p->name, nas_disk_state_names[p->state]);
 
 	return id;
 }
@@ -583,8 +1809,35 @@ int nas_disk_to_json(char *buf, const size_t len) {
 		if (i != 0)
 			buf[count++] = ',';
 		const struct nas_disk_info *p = nas_disk_list + i;
-		count += snprintf(buf + count, len - count, "\"%s\":{\"Model\":\"%s\",\"Temp\":%d}",
-				  p->name, p->model, p->temp);
+		count += snprintf(buf + count, len - count,
+				  "\"%s\":{\"Model\":\"%s\",\"Temp\":%d,\"Source\":\"%s\",\"State\":\"%s\"",
+				  p->name, p->model != NULL ? p->model : "unknown", p->temp,
+				  nas_disk_temp_source_names[p->temp_src], nas_disk_state_names[p->state]);
+		if (p->idle_window > 0)
+			count += snprintf(buf + count, len - count, ",\"Standby\":%s,\"SpinUps\":%d,\"IdleWindow\":%ld",
+					  p->standby ? "true" : "false", p->spinups, (long)(p->idle_window * p->idle_scale));
+		if (p->temp_range[3] != SCT_TEMP_INVALID)
+			count += snprintf(buf + count, len - count,
+					  ",\"TempMin\":%d,\"TempMax\":%d,\"TempLifeMin\":%d,\"TempLifeMax\":%d",
+					  p->temp_range[0], p->temp_range[1], p->temp_range[2], p->temp_range[3]);
+		if (p->temp_src == NAS_DISK_TEMP_SCSI)
+			count += snprintf(buf + count, len - count, ",\"IE\":{\"ASC\":%d,\"ASCQ\":%d}",
+					  p->ie[0], p->ie[1]);
+		if (p->io.samples > 0)
+			count += snprintf(buf + count, len - count,
+					  ",\"IO\":{\"ReadBps\":%.0f,\"WriteBps\":%.0f,\"ReadIOPS\":%.1f,\"WriteIOPS\":%.1f,"
+					  "\"Await\":%.2f,\"Util\":%.1f,\"InFlight\":[%lu,%lu]}",
+					  p->io.read_bps, p->io.write_bps, p->io.read_iops, p->io.write_iops, p->io.await,
+					  p->io.util, p->io.inflight[0], p->io.inflight[1]);
+		if (p->peer.filled > 0)
+			count += snprintf(buf + count, len - count,
+					  ",\"Peers\":{\"Group\":\"%s\",\"ServiceP50\":%.2f,\"ServiceP90\":%.2f,"
+					  "\"PeerMedian\":%.2f,\"Slow\":%s}",
+					  p->peer.group_name, nas_disk_peer_percentile(&(p->peer), 0.5),
+					  nas_disk_peer_percentile(&(p->peer), 0.9), p->peer.peers, p->peer.slow ? "true" : "false");
+		count += snprintf(buf + count, len - count, ",\"TempStats\":");
+		count += nas_stats_to_json(&(p->temp_stats), buf + count, len - count);
+		buf[count++] = '}';
 	}
 	return count;
 }
@@ -0,0 +1,125 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "nasmon.h"
+
+/*
+ * O(1) statistics of a sample stream: a fast EWMA for the current level,
+ * a slow one as the long-term baseline, Welford mean/variance and the
+ * median of the last NAS_STATS_WINDOW samples.
+ *
+ * A sample far from the median is an outlier and is rejected, unless
+ * stats_accept_after of them come in a row: then the level really moved.
+ * The fast EWMA leaving the baseline by more than the drift limit is a
+ * drift, e.g. a slowly sagging rail.
+ */
+
+static const double stats_fast_alpha = 0.3;
+static const double stats_slow_alpha = 0.01;
+static const double stats_outlier_sigma = 4;
+static const int stats_accept_after = 2;
+
+void nas_stats_init(struct nas_stats *s, const double outlier_abs, const double outlier_rel,
+		    const double drift_abs, const double drift_rel) {
+	memset(s, 0, sizeof(*s));
+	s->outlier_abs = outlier_abs;
+	s->outlier_rel = outlier_rel;
+	s->drift_abs = drift_abs;
+	s->drift_rel = drift_rel;
+}
+
+/* the level is known to have moved, e.g. a disk spun down: the next sample starts a new window */
+void nas_stats_restart(struct nas_stats *s) {
+	s->filled = 0;
+	s->pos = 0;
+	s->rejected = 0;
+}
+
+double nas_stats_median(const struct nas_stats *s) {
+	double v[NAS_STATS_WINDOW];
+	int n = s->filled;
+
+	if (n == 0)
+		return NAN;
+
+	/* insertion sort of a handful of samples */
+	for (int i = 0; i < n; i++) {
+		double x = s->window[i];
+		int j = i;
+		while ((j > 0) && (v[j - 1] > x)) {
+			v[j] = v[j - 1];
+			j--;
+		}
+		v[j] = x;
+	}
+	return (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+}
+
+double nas_stats_stddev(const struct nas_stats *s) {
+	return s->n > 1 ? sqrt(s->m2 / (double)(s->n - 1)) : 0;
+}
+
+static void nas_stats_push(struct nas_stats *s, const double x) {
+	s->window[s->pos] = x;
+	s->pos = (s->pos + 1) % NAS_STATS_WINDOW;
+	if (s->filled < NAS_STATS_WINDOW)
+		s->filled++;
+
+	s->n++;
+	double delta = x - s->mean;
+	s->mean += delta / (double)s->n;
+	s->m2 += delta * (x - s->mean);
+
+	if (s->n == 1) {
+		s->ewma = x;
+		s->baseline = x;
+	} else {
+		s->ewma += stats_fast_alpha * (x - s->ewma);
+		s->baseline += stats_slow_alpha * (x - s->baseline);
+	}
+}
+
+/* 0 if the sample is taken, NAS_STATS_OUTLIER if rejected; NAS_STATS_DRIFT flags a drift */
+int nas_stats_add(struct nas_stats *s, const double x) {
+	int rc = 0;
+
+	if (s->filled == NAS_STATS_WINDOW) {
+		double median = nas_stats_median(s);
+		double limit = s->outlier_abs + s->outlier_rel * fabs(median);
+		double sigma = stats_outlier_sigma * nas_stats_stddev(s);
+
+		if (sigma > limit)
+			limit = sigma;
+
+		if (fabs(x - median) > limit) {
+			if (++s->rejected <= stats_accept_after) {
+				s->outliers++;
+				return NAS_STATS_OUTLIER;
+			}
+			/* a step, restart the window at the new level */
+			s->filled = 0;
+			s->pos = 0;
+		}
+	}
+	s->rejected = 0;
+	nas_stats_push(s, x);
+
+	double drift = s->drift_abs + s->drift_rel * fabs(s->baseline);
+	s->drift = (drift > 0) && (s->n > NAS_STATS_WINDOW) && (fabs(s->ewma - s->baseline) > drift);
+	if (s->drift)
+		rc |= NAS_STATS_DRIFT;
+
+	return rc;
+}
+
+int nas_stats_to_json(const struct nas_stats *s, char *buf, const size_t len) {
+	return snprintf(buf, len, "{\"ewma\":%.3f,\"baseline\":%.3f,\"mean\":%.3f,\"stddev\":%.3f,"
+				  "\"median\":%.3f,\"samples\":%lu,\"outliers\":%u,\"drift\":%s}",
+			s->ewma, s->baseline, s->mean, nas_stats_stddev(s),
+			s->filled ? nas_stats_median(s) : 0, s->n, s->outliers, s->drift ? "true" : "false");
+}
@@ -22,7 +22,7 @@ static char *http_hdr = "HTTP/1.0 200\r\n"
 			"Cache-Control: max-age=30\r\n"
 			"Content-Type: application/json\r\n"
 			"Content-Length: ";
-static char send_buf[2048];
+static char send_buf[65536];
 
 void nas_stssrv_free(void) {
 	if (fd >= 0) {
@@ -77,14 +77,38 @@ int nas_stssrv_to_json(char *buf, const size_t len) {
 	strncpy(buf + count, sysload_hdr, len - count);
 	count += strlen(sysload_hdr);
 	count += nas_sysload_to_json(buf + count, len - count);
+	const char *const psi_hdr = "},\"Pressure\":{";
+	strncpy(buf + count, psi_hdr, len - count);
+	count += strlen(psi_hdr);
+	count += nas_psi_to_json(buf + count, len - count);
+	const char *const top_hdr = "},\"Processes\":{";
+	strncpy(buf + count, top_hdr, len - count);
+	count += strlen(top_hdr);
+	count += nas_top_to_json(buf + count, len - count);
 	const char *const sensor_hdr = "},\"Sensors\":{";
 	strncpy(buf + count, sensor_hdr, len - count);
 	count += strlen(sensor_hdr);
 	count += nas_sensor_to_json(buf + count, len - count);
+	const char *const fan_hdr = "},\"Fans\":{";
+	strncpy(buf + count, fan_hdr, len - count);
+	count += strlen(fan_hdr);
+	count += nas_fan_to_json(buf + count, len - count);
+	const char *const cpu_hdr = "},\"CPU\":{";
+	strncpy(buf + count, cpu_hdr, len - count);
+	count += strlen(cpu_hdr);
+	count += cpu_freq_to_json(buf + count, len - count);
+	const char *const guard_hdr = "},\"Guard\":{";
+	strncpy(buf + count, guard_hdr, len - count);
+	count += strlen(guard_hdr);
+	count += nas_guard_to_json(buf + count, len - count);
 	const char *const disk_hdr = "},\"Disks\":{";
 	strncpy(buf + count, disk_hdr, len - count);
 	count += strlen(disk_hdr);
 	count += nas_disk_to_json(buf + count, len - count);
+	const char *const raid_hdr = "},\"RAID\":{";
+	strncpy(buf + count, raid_hdr, len - count);
+	count += strlen(raid_hdr);
+	count += nas_raid_to_json(buf + count, len - count);
 	const char *const ifs_hdr = "},\"NICs\":{";
 	strncpy(buf + count, ifs_hdr, len - count);
 	count += strlen(ifs_hdr);
@@ -99,7 +123,7 @@ void nas_stssrv_export(void) {
 	struct sockaddr_in accept_addr;
 	unsigned int accept_addr_len = sizeof(accept_addr);
 	int offset = 0;
-	char buf[1920];
+	char buf[sizeof(send_buf) - 128];
 
 	int client_fd = accept(fd, (struct sockaddr *)&accept_addr, &accept_addr_len);
 	if (client_fd < 0) {
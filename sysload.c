@@ -3,6 +3,11 @@
  */
 
 #include <sys/sysinfo.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,15 +15,118 @@
 #include "nasmon.h"
 
 static const double linux_loads_scale = 65536.0;
+static const time_t psi_stall_show = 60;    /* seconds a stall stays on the summary */
 static struct sysinfo info;
 
-static const char *nas_sysload_titles[] = {
+/* /proc/stat, kept open and re-read on every tick */
+enum {
+	NAS_CPU_USER,
+	NAS_CPU_NICE,
+	NAS_CPU_SYSTEM,
+	NAS_CPU_IDLE,
+	NAS_CPU_IOWAIT,
+	NAS_CPU_IRQ,
+	NAS_CPU_SOFTIRQ,
+	NAS_CPU_STEAL,
+	NAS_CPU_FIELDS
+};
+
+struct nas_cpu_stat {
+	unsigned long long ticks[NAS_CPU_FIELDS];
+	float user;
+	float system;
+	float iowait;
+	float steal;
+	float idle;
+};
+
+/* a /proc file kept open and re-read from offset 0 */
+struct nas_proc_file {
+	const char *path;
+	int fd;
+	char *buf;
+	size_t size;
+};
+
+static struct nas_proc_file nas_stat_file = {"/proc/stat", -1, NULL, 0};
+static struct nas_proc_file nas_meminfo_file = {"/proc/meminfo", -1, NULL, 0};
+static struct nas_proc_file nas_vmstat_file = {"/proc/vmstat", -1, NULL, 0};
+static struct timespec nas_stat_ts;
+static int nas_stat_samples = 0;
+
+/* [0] is the sum over all CPUs */
+static int nas_cpu_count = 0;
+static struct nas_cpu_stat *nas_cpu_stats = NULL;
+
+static unsigned long long nas_ctxt = 0;
+static unsigned long long nas_intr = 0;
+static unsigned long long nas_forks = 0;
+static double nas_ctxt_rate = 0;
+static double nas_intr_rate = 0;
+static double nas_fork_rate = 0;
+static unsigned long long nas_procs_running = 0;
+static unsigned long long nas_procs_blocked = 0;
+
+/* /proc/meminfo, in kB */
+enum {
+	NAS_MEM_TOTAL,
+	NAS_MEM_FREE,
+	NAS_MEM_AVAILABLE,
+	NAS_MEM_BUFFERS,
+	NAS_MEM_CACHED,
+	NAS_MEM_SWAP_CACHED,
+	NAS_MEM_DIRTY,
+	NAS_MEM_WRITEBACK,
+	NAS_MEM_SLAB,
+	NAS_MEM_SHMEM,
+	NAS_MEM_SWAP_TOTAL,
+	NAS_MEM_SWAP_FREE,
+	NAS_MEM_FIELDS
+};
+
+static const char *const nas_meminfo_keys[NAS_MEM_FIELDS] = {
+	"MemTotal:", "MemFree:", "MemAvailable:", "Buffers:", "Cached:", "SwapCached:",
+	"Dirty:", "Writeback:", "Slab:", "Shmem:", "SwapTotal:", "SwapFree:"
+};
+static const char *const nas_meminfo_names[NAS_MEM_FIELDS] = {
+	"total", "free", "available", "buffers", "cached", "swap_cached",
+	"dirty", "writeback", "slab", "shmem", "swap_total", "swap_free"
+};
+static unsigned long long nas_meminfo[NAS_MEM_FIELDS];
+
+/* /proc/vmstat counters, as rates per second */
+enum {
+	NAS_VM_PGMAJFAULT,
+	NAS_VM_PSWPIN,
+	NAS_VM_PSWPOUT,
+	NAS_VM_PGPGIN,
+	NAS_VM_PGPGOUT,
+	NAS_VM_FIELDS
+};
+
+static const char *const nas_vmstat_keys[NAS_VM_FIELDS] = {
+	"pgmajfault", "pswpin", "pswpout", "pgpgin", "pgpgout"
+};
+static unsigned long long nas_vmstat[NAS_VM_FIELDS];
+static double nas_vmstat_rates[NAS_VM_FIELDS];
+
+#define NAS_SYSLOAD_PAGES 14
+
+static const char *nas_sysload_titles[NAS_SYSLOAD_PAGES] = {
 	"Load Average:",
 	"Processes:",
 	"Memory InUse:",
-	"Memory Shared:",
-	"Memory Buffer:",
-	"Swap InUse:"
+	"Memory Cached:",
+	"Dirty Writeback:",
+	"Swap InUse:",
+	"Swap i/o majf/s:",
+	"CPU us sy wa st:",
+	"ctxt intr fork/s",
+	"PSI10s cpu m io:",
+	"Stalls cpu m io:",
+	"Top CPU:",
+	"Top Memory:",
+	"Top I/O:"
 };
 static const char *nas_mem_load_fmt = "%lu/%lu";
 
@@ -26,14 +134,239 @@ void nas_sysload_update(void) {
 	sysinfo(&info);
 }
 
+static void nas_proc_close(struct nas_proc_file *f) {
+	if (f->fd >= 0)
+		nas_safe_close(f->fd);
+	free(f->buf);
+}
+
+static void nas_sysload_free(void) {
+	nas_proc_close(&nas_stat_file);
+	nas_proc_close(&nas_meminfo_file);
+	nas_proc_close(&nas_vmstat_file);
+	free(nas_cpu_stats);
+}
+
+static void nas_proc_open(struct nas_proc_file *f) {
+	f->size = 4096;
+	if ((f->buf = malloc(f->size)) == NULL) {
+		syslog(LOG_ERR, "allocate memory for %s failed: %d", f->path, errno);
+		exit(EXIT_FAILURE);
+	}
+	if ((f->fd = open(f->path, O_RDONLY)) < 0)
+		syslog(LOG_ERR, "open %s failed: %d", f->path, errno);
+}
+
+void nas_sysload_init(void) {
+	nas_sysload_update();
+
+	nas_cpu_count = (int)sysconf(_SC_NPROCESSORS_CONF);
+	if (nas_cpu_count < 1)
+		nas_cpu_count = 1;
+
+	nas_cpu_stats = calloc((size_t)nas_cpu_count + 1, sizeof(*nas_cpu_stats));
+	if (nas_cpu_stats == NULL) {
+		syslog(LOG_ERR, "allocate memory for /proc/stat failed: %d", errno);
+		exit(EXIT_FAILURE);
+	}
+	atexit(nas_sysload_free);
+
+	nas_proc_open(&nas_stat_file);
+	nas_proc_open(&nas_meminfo_file);
+	nas_proc_open(&nas_vmstat_file);
+
+	nas_sysload_sample();
+}
+
+/* read the whole file at offset 0, growing the buffer until it fits */
+static ssize_t nas_proc_read(struct nas_proc_file *f) {
+	if (f->fd < 0)
+		return -1;
+
+	while (1) {
+		ssize_t n = pread(f->fd, f->buf, f->size - 1, 0);
+		if (n < 0)
+			return -1;
+		if (n < (ssize_t)f->size - 1) {
+			f->buf[n] = '\0';
+			return n;
+		}
+
+		char *buf = realloc(f->buf, f->size * 2);
+		if (buf == NULL)
+			return -1;
+		f->buf = buf;
+		f->size *= 2;
+	}
+}
+
+/* zero-copy tokenizer over the read buffer */
+static const char *nas_stat_ull(const char *p, unsigned long long *value) {
+	unsigned long long v = 0;
+
+	while (*p == ' ')
+		p++;
+	while ((*p >= '0') && (*p <= '9'))
+		v = v * 10 + (unsigned long long)(*p++ - '0');
+
+	*value = v;
+	return p;
+}
+
+static int nas_stat_key(const char *p, const char *key, const char **value) {
+	size_t len = strlen(key);
+
+	if ((strncmp(p, key, len) != 0) || (p[len] != ' '))
+		return 0;
+	*value = p + len;
+	return 1;
+}
+
+static void nas_cpu_stat_update(struct nas_cpu_stat *c, const char *p) {
+	unsigned long long ticks[NAS_CPU_FIELDS];
+	unsigned long long total = 0;
+
+	for (int i = 0; i < NAS_CPU_FIELDS; i++) {
+		p = nas_stat_ull(p, ticks + i);
+		total += ticks[i] - c->ticks[i];
+	}
+
+	if (total > 0) {
+		double scale = 100.0 / (double)total;
+		c->user = (float)((ticks[NAS_CPU_USER] - c->ticks[NAS_CPU_USER] +
+				   ticks[NAS_CPU_NICE] - c->ticks[NAS_CPU_NICE]) * scale);
+		c->system = (float)((ticks[NAS_CPU_SYSTEM] - c->ticks[NAS_CPU_SYSTEM] +
+				     ticks[NAS_CPU_IRQ] - c->ticks[NAS_CPU_IRQ] +
+				     ticks[NAS_CPU_SOFTIRQ] - c->ticks[NAS_CPU_SOFTIRQ]) * scale);
+		c->iowait = (float)((ticks[NAS_CPU_IOWAIT] - c->ticks[NAS_CPU_IOWAIT]) * scale);
+		c->steal = (float)((ticks[NAS_CPU_STEAL] - c->ticks[NAS_CPU_STEAL]) * scale);
+		c->idle = (float)((ticks[NAS_CPU_IDLE] - c->ticks[NAS_CPU_IDLE]) * scale);
+	}
+	memcpy(c->ticks, ticks, sizeof(ticks));
+}
+
+static double nas_stat_rate(unsigned long long *last, const unsigned long long now, const double dt) {
+	double rate = (dt > 0) && (nas_stat_samples > 0) ? (double)(now - *last) / dt : 0;
+	*last = now;
+	return rate;
+}
+
+static const char *nas_proc_next_line(const char *p) {
+	p = strchr(p, '\n');
+	return p != NULL ? p + 1 : NULL;
+}
+
+static void nas_stat_parse(const double dt) {
+	const char *p = nas_stat_file.buf;
+	const char *v;
+	unsigned long long value;
+
+	while (*p != '\0') {
+		if ((p[0] == 'c') && (p[1] == 'p') && (p[2] == 'u')) {
+			if (p[3] == ' ')
+				nas_cpu_stat_update(nas_cpu_stats, p + 3);
+			else {
+				const char *q = nas_stat_ull(p + 3, &value);
+				if (value < (unsigned long long)nas_cpu_count)
+					nas_cpu_stat_update(nas_cpu_stats + 1 + value, q);
+			}
+		} else if (nas_stat_key(p, "ctxt", &v)) {
+			nas_stat_ull(v, &value);
+			nas_ctxt_rate = nas_stat_rate(&nas_ctxt, value, dt);
+		} else if (nas_stat_key(p, "intr", &v)) {
+			/* only the total, the per-irq counters may run for kilobytes */
+			nas_stat_ull(v, &value);
+			nas_intr_rate = nas_stat_rate(&nas_intr, value, dt);
+		} else if (nas_stat_key(p, "processes", &v)) {
+			nas_stat_ull(v, &value);
+			nas_fork_rate = nas_stat_rate(&nas_forks, value, dt);
+		} else if (nas_stat_key(p, "procs_running", &v))
+			nas_stat_ull(v, &nas_procs_running);
+		else if (nas_stat_key(p, "procs_blocked", &v))
+			nas_stat_ull(v, &nas_procs_blocked);
+
+		if ((p = nas_proc_next_line(p)) == NULL)
+			break;
+	}
+}
+
+static void nas_meminfo_parse(void) {
+	const char *v;
+
+	for (const char *p = nas_meminfo_file.buf; (p != NULL) && (*p != '\0'); p = nas_proc_next_line(p)) {
+		for (int i = 0; i < NAS_MEM_FIELDS; i++) {
+			if (nas_stat_key(p, nas_meminfo_keys[i], &v)) {
+				nas_stat_ull(v, nas_meminfo + i);
+				break;
+			}
+		}
+	}
+
+	/* kernels before 3.14 have no MemAvailable, estimate it the old way */
+	if (nas_meminfo[NAS_MEM_AVAILABLE] == 0)
+		nas_meminfo[NAS_MEM_AVAILABLE] = nas_meminfo[NAS_MEM_FREE] + nas_meminfo[NAS_MEM_BUFFERS] +
+						 nas_meminfo[NAS_MEM_CACHED];
+}
+
+static void nas_vmstat_parse(const double dt) {
+	const char *v;
+	unsigned long long value;
+
+	for (const char *p = nas_vmstat_file.buf; (p != NULL) && (*p != '\0'); p = nas_proc_next_line(p)) {
+		for (int i = 0; i < NAS_VM_FIELDS; i++) {
+			if (nas_stat_key(p, nas_vmstat_keys[i], &v)) {
+				nas_stat_ull(v, &value);
+				nas_vmstat_rates[i] = nas_stat_rate(nas_vmstat + i, value, dt);
+				break;
+			}
+		}
+	}
+}
+
+/* called on every tick: CPU shares since the last one, memory, and event rates */
+void nas_sysload_sample(void) {
+	double dt = nas_stat_samples > 0 ? nas_elapsed_ms(&nas_stat_ts) / 1000.0 : 0;
+	clock_gettime(CLOCK_MONOTONIC, &nas_stat_ts);
+
+	if (nas_proc_read(&nas_stat_file) >= 0)
+		nas_stat_parse(dt);
+	if (nas_proc_read(&nas_meminfo_file) >= 0)
+		nas_meminfo_parse();
+	if (nas_proc_read(&nas_vmstat_file) >= 0)
+		nas_vmstat_parse(dt);
+	nas_stat_samples++;
+}
+
+static unsigned long nas_mem_mb(const unsigned long long kb) {
+	return (unsigned long)(kb / 1024);
+}
+
+static const char *nas_rate_fmt(char *buf, const size_t len, const double rate) {
+	if (rate >= 10000)
+		snprintf(buf, len, "%.0fk", rate / 1000);
+	else if (rate >= 1000)
+		snprintf(buf, len, "%.1fk", rate / 1000);
+	else
+		snprintf(buf, len, "%.0f", rate);
+	return buf;
+}
+
 int nas_sysload_item_show(const int off) {
 	static int id = -1;
-	unsigned long mem_in_mb;
+	char rate[3][8];
 
-	id = id >= 0 ? (6 + id + off) % 6 : 0;
+	/* the fixed pages, then one per CPU */
+	int pages = NAS_SYSLOAD_PAGES + nas_cpu_count;
+	id = id >= 0 ? (pages + id + off) % pages : 0;
 
 	sysinfo(&info);
-	mem_in_mb = 1024 * 1024 / info.mem_unit;
+
+	if (id >= NAS_SYSLOAD_PAGES) {
+		const struct nas_cpu_stat *c = nas_cpu_stats + 1 + id - NAS_SYSLOAD_PAGES;
+		lcd_printf(1, "CPU%d us sy wa st", id - NAS_SYSLOAD_PAGES);
+		lcd_printf(2, "%.0f %.0f %.0f %.0f", c->user, c->system, c->iowait, c->steal);
+		return id;
+	}
 
 	lcd_printf(1, nas_sysload_titles[id]);
 
@@ -50,24 +383,62 @@ int nas_sysload_item_show(const int off) {
 			break;
 		case 2:
 			lcd_printf(2, nas_mem_load_fmt,
-				   (info.totalram - info.freeram) / mem_in_mb,
-				   info.totalram / mem_in_mb);
+				   nas_mem_mb(nas_meminfo[NAS_MEM_TOTAL] - nas_meminfo[NAS_MEM_AVAILABLE]),
+				   nas_mem_mb(nas_meminfo[NAS_MEM_TOTAL]));
 			break;
 		case 3:
 			lcd_printf(2, nas_mem_load_fmt,
-				   info.sharedram / mem_in_mb,
-				   info.totalram / mem_in_mb);
+				   nas_mem_mb(nas_meminfo[NAS_MEM_CACHED] + nas_meminfo[NAS_MEM_BUFFERS]),
+				   nas_mem_mb(nas_meminfo[NAS_MEM_TOTAL]));
 			break;
 		case 4:
-			lcd_printf(2, nas_mem_load_fmt,
-				   info.bufferram / mem_in_mb,
-				   info.totalram / mem_in_mb);
+			lcd_printf(2, "%lu/%lu MB", nas_mem_mb(nas_meminfo[NAS_MEM_DIRTY]),
+				   nas_mem_mb(nas_meminfo[NAS_MEM_WRITEBACK]));
 			break;
 		case 5:
 			lcd_printf(2, nas_mem_load_fmt,
-				   (info.totalswap - info.freeswap) / mem_in_mb,
-				   info.totalswap / mem_in_mb);
+				   nas_mem_mb(nas_meminfo[NAS_MEM_SWAP_TOTAL] - nas_meminfo[NAS_MEM_SWAP_FREE]),
+				   nas_mem_mb(nas_meminfo[NAS_MEM_SWAP_TOTAL]));
+			break;
+		case 6:
+			lcd_printf(2, "%s %s %s",
+				   nas_rate_fmt(rate[0], sizeof(rate[0]), nas_vmstat_rates[NAS_VM_PSWPIN]),
+				   nas_rate_fmt(rate[1], sizeof(rate[1]), nas_vmstat_rates[NAS_VM_PSWPOUT]),
+				   nas_rate_fmt(rate[2], sizeof(rate[2]), nas_vmstat_rates[NAS_VM_PGMAJFAULT]));
+			break;
+		case 7:
+			lcd_printf(2, "%.0f %.0f %.0f %.0f", nas_cpu_stats[0].user, nas_cpu_stats[0].system,
+				   nas_cpu_stats[0].iowait, nas_cpu_stats[0].steal);
+			break;
+		case 8:
+			lcd_printf(2, "%s %s %s", nas_rate_fmt(rate[0], sizeof(rate[0]), nas_ctxt_rate),
+				   nas_rate_fmt(rate[1], sizeof(rate[1]), nas_intr_rate),
+				   nas_rate_fmt(rate[2], sizeof(rate[2]), nas_fork_rate));
 			break;
+		case 9:
+			lcd_printf(2, "%.1f %.1f %.1f%%", nas_psi_avg10(NAS_PSI_CPU), nas_psi_avg10(NAS_PSI_MEMORY),
+				   nas_psi_avg10(NAS_PSI_IO));
+			break;
+		case 10:
+			lcd_printf(2, "%lu %lu %lu", nas_psi_events(NAS_PSI_CPU), nas_psi_events(NAS_PSI_MEMORY),
+				   nas_psi_events(NAS_PSI_IO));
+			break;
+		case 11:
+		case 12:
+		case 13: {
+			/* the value first, a long name is cut at the end of the line */
+			static const char *const top_fmt[NAS_TOP_KEYS] = {"%.0f%% %s", "%.0fM %s", "%.1fM/s %s"};
+			static const double top_scale[NAS_TOP_KEYS] = {1, 1.0 / (1024 * 1024), 1.0 / (1000 * 1000)};
+			int key = id - 11;
+			double value;
+			const char *name = nas_top_first(key, &value);
+
+			if (name != NULL)
+				lcd_printf(2, top_fmt[key], value * top_scale[key], name);
+			else
+				lcd_printf(2, "-");
+			break;
+		}
 		default:
 			break;
 	}
@@ -76,26 +447,43 @@ int nas_sysload_item_show(const int off) {
 }
 
 void nas_sysload_summary_show(void) {
-	unsigned long mem_in_mb;
+	static const char *const psi_names[NAS_PSI_RESOURCES] = {" cpu", " mem", " io"};
+	char stall[LCD_LINE_CHARS + 1] = "Stall:";
 
 	sysinfo(&info);
-	mem_in_mb = 1024 * 1024 / info.mem_unit;
 
-	lcd_printf(1, "L: %.1f %.1f %.1f",
-		   ((double)info.loads[0]) / linux_loads_scale,
-		   ((double)info.loads[1]) / linux_loads_scale,
-		   ((double)info.loads[2]) / linux_loads_scale);
+	/* a recent pressure stall replaces the load average */
+	for (int i = 0; i < NAS_PSI_RESOURCES; i++) {
+		if (nas_psi_stalled(i, time(NULL), psi_stall_show))
+			strncat(stall, psi_names[i] + (stall[6] == '\0'), sizeof(stall) - strlen(stall) - 1);
+	}
+
+	if (stall[6] != '\0')
+		lcd_printf(1, stall);
+	else
+		lcd_printf(1, "L: %.1f %.1f %.1f",
+			   ((double)info.loads[0]) / linux_loads_scale,
+			   ((double)info.loads[1]) / linux_loads_scale,
+			   ((double)info.loads[2]) / linux_loads_scale);
 	lcd_printf(2, "%hu %lu/%lu",
 		   info.procs,
-		   (info.totalram - info.freeram) / mem_in_mb,
-		   info.totalram / mem_in_mb);
+		   nas_mem_mb(nas_meminfo[NAS_MEM_TOTAL] - nas_meminfo[NAS_MEM_AVAILABLE]),
+		   nas_mem_mb(nas_meminfo[NAS_MEM_TOTAL]));
+}
+
+static int nas_cpu_stat_to_json(char *buf, const size_t len, const char *name, const struct nas_cpu_stat *c) {
+	return snprintf(buf, len, "\"%s\":{\"user\":%.1f,\"system\":%.1f,\"iowait\":%.1f,\"steal\":%.1f,\"idle\":%.1f}",
+			name, c->user, c->system, c->iowait, c->steal, c->idle);
 }
 
 int nas_sysload_to_json(char *buf, const size_t len) {
 	struct timespec ts;
+	char name[16];
+	int count;
+
 	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
 	nas_sysload_update();
-	return snprintf(
+	count = snprintf(
 		buf, len,
 		"\"time\":%ld,\"uptime\":%ld,\"load\":{\"1m\":%.2f,\"5m\":%.2f,\"15m\":%.2f},"
 		"\"procs\":%hu,\"memory\":{\"total\":%lu,\"free\":%lu,\"shared\":"
@@ -105,5 +493,28 @@ int nas_sysload_to_json(char *buf, const size_t len) {
 		info.loads[2] / linux_loads_scale,
 		info.procs, info.totalram * info.mem_unit,
 		info.freeram * info.mem_unit, info.sharedram * info.mem_unit,
-		info.bufferram * info.mem_unit, info.totalswap, info.freeswap);
+		info.bufferram * info.mem_unit, info.totalswap * info.mem_unit, info.freeswap * info.mem_unit);
+
+	count += snprintf(buf + count, len - count, ",\"meminfo\":{");
+	for (int i = 0; i < NAS_MEM_FIELDS; i++)
+		count += snprintf(buf + count, len - count, "%s\"%s\":%llu", i ? "," : "", nas_meminfo_names[i],
+				  nas_meminfo[i] * 1024);
+	count += snprintf(buf + count, len - count, "},\"paging\":{");
+	for (int i = 0; i < NAS_VM_FIELDS; i++)
+		count += snprintf(buf + count, len - count, "%s\"%s\":%.1f", i ? "," : "", nas_vmstat_keys[i],
+				  nas_vmstat_rates[i]);
+	buf[count++] = '}';
+
+	count += snprintf(buf + count, len - count, ",\"cpu\":{");
+	count += nas_cpu_stat_to_json(buf + count, len - count, "all", nas_cpu_stats);
+	for (int i = 0; i < nas_cpu_count; i++) {
+		snprintf(name, sizeof(name), "cpu%d", i);
+		buf[count++] = ',';
+		count += nas_cpu_stat_to_json(buf + count, len - count, name, nas_cpu_stats + 1 + i);
+	}
+	count += snprintf(buf + count, len - count,
+			  "},\"rates\":{\"ctxt\":%.1f,\"intr\":%.1f,\"fork\":%.1f},"
+			  "\"procs_running\":%llu,\"procs_blocked\":%llu",
+			  nas_ctxt_rate, nas_intr_rate, nas_fork_rate, nas_procs_running, nas_procs_blocked);
+	return count;
 }
\ No newline at end of file
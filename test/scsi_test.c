@@ -0,0 +1,164 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nasmon.h"
+
+/* canned pages as a drive returns them, the buffer size is what the transport transferred */
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static void test_log_param(void) {
+	/* temperature page, parameter 0000 current and 0001 reference temperature */
+	const unsigned char page[] = {0x0D, 0x00, 0x00, 0x0C,
+				      0x00, 0x00, 0x03, 0x02, 0x00, 0x24,
+				      0x00, 0x01, 0x03, 0x02, 0x00, 0x41};
+
+	CHECK(scsi_log_param(page, sizeof(page), 0) == page + 4);
+	CHECK(scsi_log_param(page, sizeof(page), 1) == page + 10);
+	CHECK(scsi_log_param(page, sizeof(page), 2) == NULL);
+
+	/* the transfer is shorter than the page, the second parameter is cut */
+	CHECK(scsi_log_param(page, 14, 0) == page + 4);
+	CHECK(scsi_log_param(page, 14, 1) == NULL);
+
+	/* the page length ends before the second parameter */
+	const unsigned char short_page[] = {0x0D, 0x00, 0x00, 0x06,
+					    0x00, 0x00, 0x03, 0x02, 0x00, 0x24,
+					    0x00, 0x01, 0x03, 0x02, 0x00, 0x41};
+	CHECK(scsi_log_param(short_page, sizeof(short_page), 0) == short_page + 4);
+	CHECK(scsi_log_param(short_page, sizeof(short_page), 1) == NULL);
+
+	/* a parameter length running past the page end, and past the buffer */
+	const unsigned char long_param[] = {0x0D, 0x00, 0x00, 0x06,
+					    0x00, 0x00, 0x03, 0x08, 0x00, 0x24};
+	CHECK(scsi_log_param(long_param, sizeof(long_param), 0) == NULL);
+
+	const unsigned char huge_page[] = {0x0D, 0x00, 0xFF, 0xFF,
+					   0x00, 0x00, 0x03, 0xFF, 0x00, 0x24};
+	CHECK(scsi_log_param(huge_page, sizeof(huge_page), 0) == NULL);
+
+	/* no room for the page header */
+	CHECK(scsi_log_param(page, 3, 0) == NULL);
+	CHECK(scsi_log_param(page, 0, 0) == NULL);
+}
+
+static void test_log_temperature(void) {
+	char temp = 0;
+
+	const unsigned char page[] = {0x0D, 0x00, 0x00, 0x0C,
+				      0x00, 0x00, 0x03, 0x02, 0x00, 0x24,
+				      0x00, 0x01, 0x03, 0x02, 0x00, 0x41};
+	CHECK(scsi_log_temperature(page, sizeof(page), &temp) == 0);
+	CHECK(temp == 36);
+
+	const unsigned char invalid[] = {0x0D, 0x00, 0x00, 0x06,
+					 0x00, 0x00, 0x03, 0x02, 0x00, 0xFF};
+	temp = 0;
+	CHECK(scsi_log_temperature(invalid, sizeof(invalid), &temp) == -1);
+	CHECK(temp == 0);
+
+	/* a parameter too short to hold the temperature */
+	const unsigned char short_param[] = {0x0D, 0x00, 0x00, 0x05,
+					     0x00, 0x00, 0x03, 0x01, 0x00};
+	CHECK(scsi_log_temperature(short_param, sizeof(short_param), &temp) == -1);
+
+	/* the temperature byte itself was not transferred */
+	CHECK(scsi_log_temperature(page, 9, &temp) == -1);
+
+	/* only the reference temperature */
+	const unsigned char reference[] = {0x0D, 0x00, 0x00, 0x06,
+					   0x00, 0x01, 0x03, 0x02, 0x00, 0x41};
+	CHECK(scsi_log_temperature(reference, sizeof(reference), &temp) == -1);
+}
+
+static void test_log_ie(void) {
+	unsigned char ie[2] = {0, 0};
+	char temp = 0;
+
+	/* failure prediction threshold exceeded (5D/10), at 40C */
+	const unsigned char page[] = {0x2F, 0x00, 0x00, 0x08,
+				      0x00, 0x00, 0x03, 0x04, 0x5D, 0x10, 0x28, 0x00};
+	CHECK(scsi_log_ie(page, sizeof(page), ie, &temp) == 0);
+	CHECK((ie[0] == 0x5D) && (ie[1] == 0x10));
+	CHECK(temp == 40);
+
+	/* no temperature with the exception */
+	const unsigned char no_temp[] = {0x2F, 0x00, 0x00, 0x06,
+					 0x00, 0x00, 0x03, 0x02, 0x00, 0x00};
+	temp = 1;
+	CHECK(scsi_log_ie(no_temp, sizeof(no_temp), ie, &temp) == 0);
+	CHECK((ie[0] == 0) && (ie[1] == 0));
+	CHECK(temp == 0);
+
+	const unsigned char invalid[] = {0x2F, 0x00, 0x00, 0x07,
+					 0x00, 0x00, 0x03, 0x03, 0x00, 0x00, 0xFF};
+	temp = 1;
+	CHECK(scsi_log_ie(invalid, sizeof(invalid), ie, &temp) == 0);
+	CHECK(temp == 0);
+
+	/* cut in the middle of the parameter, nothing is taken from it */
+	ie[0] = ie[1] = 0xAA;
+	CHECK(scsi_log_ie(page, 10, ie, &temp) == -1);
+	CHECK((ie[0] == 0xAA) && (ie[1] == 0xAA));
+
+	const unsigned char past_end[] = {0x2F, 0x00, 0x00, 0x08,
+					  0x00, 0x00, 0x03, 0x10, 0x5D, 0x10, 0x28, 0x00};
+	CHECK(scsi_log_ie(past_end, sizeof(past_end), ie, &temp) == -1);
+}
+
+static void test_log_supported(void) {
+	const unsigned char pages[] = {0x00, 0x00, 0x00, 0x05, 0x00, 0x02, 0x0D, 0x2F, 0x30};
+
+	CHECK(scsi_log_supported(pages, sizeof(pages), 0x0D));
+	CHECK(scsi_log_supported(pages, sizeof(pages), 0x2F));
+	CHECK(!scsi_log_supported(pages, sizeof(pages), 0x10));
+
+	/* the list goes on past the transfer */
+	const unsigned char cut[] = {0x00, 0x00, 0x00, 0x20, 0x00, 0x0D};
+	CHECK(scsi_log_supported(cut, sizeof(cut), 0x0D));
+	CHECK(!scsi_log_supported(cut, sizeof(cut), 0x2F));
+
+	/* a page length shorter than the transfer */
+	const unsigned char short_list[] = {0x00, 0x00, 0x00, 0x02, 0x00, 0x0D, 0x2F};
+	CHECK(scsi_log_supported(short_list, sizeof(short_list), 0x0D));
+	CHECK(!scsi_log_supported(short_list, sizeof(short_list), 0x2F));
+
+	CHECK(!scsi_log_supported(pages, 3, 0x00));
+}
+
+static void test_vpd_rotation_rate(void) {
+	const unsigned char hdd[] = {0x00, 0xB1, 0x00, 0x3C, 0x1C, 0x20, 0x00, 0x00};
+	const unsigned char ssd[] = {0x00, 0xB1, 0x00, 0x3C, 0x00, 0x01, 0x00, 0x00};
+	const unsigned char empty[] = {0x00, 0xB1, 0x00, 0x00, 0x1C, 0x20};
+
+	CHECK(scsi_vpd_rotation_rate(hdd, sizeof(hdd)) == 7200);
+	CHECK(scsi_vpd_rotation_rate(ssd, sizeof(ssd)) == 1);
+	CHECK(scsi_vpd_rotation_rate(empty, sizeof(empty)) == 0);
+	CHECK(scsi_vpd_rotation_rate(hdd, 5) == 0);
+}
+
+int main(void) {
+	test_log_param();
+	test_log_temperature();
+	test_log_ie();
+	test_log_supported();
+	test_vpd_rotation_rate();
+
+	if (failures > 0) {
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
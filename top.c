@@ -0,0 +1,363 @@
+/*
+ * Created by benstone on 2026/10/18.
+ */
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nasmon.h"
+
+/*
+ * Top resource consumers: every top_scan_interval seconds the pids in
+ * /proc are read through openat() on the /proc directory fd, the CPU
+ * time, RSS and I/O bytes are diffed against the previous scan, and the
+ * heaviest NAS_TOP_COUNT processes by each are kept in small min-heaps.
+ *
+ * A pid that used no CPU since the last scan can not have issued I/O
+ * either, its io file is not re-read. Kernel threads have no io worth
+ * tracking and no RSS, they only compete on CPU.
+ */
+
+static const time_t top_scan_interval = 30;
+
+struct nas_top_proc {
+	pid_t pid;
+	unsigned long long start;   /* starttime, tells a reused pid apart */
+	unsigned long long ticks;   /* utime + stime */
+	unsigned long long io;      /* read_bytes + write_bytes */
+	unsigned long rss;          /* pages */
+	int kthread;
+	float cpu;                  /* % of one CPU */
+	float io_rate;              /* bytes/s */
+	char comm[16];
+};
+
+static DIR *nas_top_dir = NULL;
+static long nas_top_clk_tck = 100;
+static long nas_top_page_size = 4096;
+static time_t nas_top_ts = 0;
+static struct timespec nas_top_scan_ts;
+static int nas_top_scans = 0;
+static double nas_top_scan_ms = 0;
+
+/* the cache of the last scan, sorted by pid */
+static struct nas_top_proc *nas_top_procs = NULL;
+static int nas_top_count = 0;
+static int nas_top_size = 0;
+static struct nas_top_proc *nas_top_next = NULL;
+static int nas_top_next_size = 0;
+
+struct nas_top_heap {
+	const char *name;
+	int count;
+	struct nas_top_proc items[NAS_TOP_COUNT];
+};
+
+static struct nas_top_heap nas_top_heaps[NAS_TOP_KEYS] = {
+	{"cpu"},
+	{"rss"},
+	{"io"}
+};
+
+static double nas_top_key(const struct nas_top_proc *p, const int key) {
+	switch (key) {
+		case NAS_TOP_CPU:
+			return p->cpu;
+		case NAS_TOP_RSS:
+			return (double)p->rss;
+		default:
+			return p->io_rate;
+	}
+}
+
+static void nas_top_swap(struct nas_top_proc *a, struct nas_top_proc *b) {
+	struct nas_top_proc t = *a;
+	*a = *b;
+	*b = t;
+}
+
+/* min-heap of at most NAS_TOP_COUNT, the root is the smallest kept */
+static void nas_top_heap_push(struct nas_top_heap *h, const int key, const struct nas_top_proc *p) {
+	double v = nas_top_key(p, key);
+	int i;
+
+	if (v <= 0)
+		return;
+
+	if (h->count < NAS_TOP_COUNT) {
+		i = h->count++;
+		h->items[i] = *p;
+		while ((i > 0) && (nas_top_key(h->items + (i - 1) / 2, key) > nas_top_key(h->items + i, key))) {
+			nas_top_swap(h->items + (i - 1) / 2, h->items + i);
+			i = (i - 1) / 2;
+		}
+		return;
+	}
+
+	if (v <= nas_top_key(h->items, key))
+		return;
+
+	h->items[0] = *p;
+	i = 0;
+	while (1) {
+		int min = i;
+		int l = 2 * i + 1;
+		int r = l + 1;
+
+		if ((l < h->count) && (nas_top_key(h->items + l, key) < nas_top_key(h->items + min, key)))
+			min = l;
+		if ((r < h->count) && (nas_top_key(h->items + r, key) < nas_top_key(h->items + min, key)))
+			min = r;
+		if (min == i)
+			break;
+		nas_top_swap(h->items + i, h->items + min);
+		i = min;
+	}
+}
+
+/* heap order to descending order, for the exporters */
+static void nas_top_heap_sort(struct nas_top_heap *h, const int key) {
+	for (int i = 1; i < h->count; i++) {
+		struct nas_top_proc p = h->items[i];
+		int j = i;
+		while ((j > 0) && (nas_top_key(h->items + j - 1, key) < nas_top_key(&p, key))) {
+			h->items[j] = h->items[j - 1];
+			j--;
+		}
+		h->items[j] = p;
+	}
+}
+
+static void nas_top_free(void) {
+	if (nas_top_dir != NULL)
+		closedir(nas_top_dir);
+	free(nas_top_procs);
+	free(nas_top_next);
+}
+
+void nas_top_init(void) {
+	if ((nas_top_dir = opendir("/proc")) == NULL) {
+		syslog(LOG_ERR, "open /proc failed: %d", errno);
+		return;
+	}
+	atexit(nas_top_free);
+
+	nas_top_clk_tck = sysconf(_SC_CLK_TCK);
+	nas_top_page_size = sysconf(_SC_PAGESIZE);
+}
+
+static ssize_t nas_top_read(const int dir_fd, const char *path, char *buf, const size_t len) {
+	int fd = openat(dir_fd, path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	ssize_t n = read(fd, buf, len - 1);
+	nas_safe_close(fd);
+	if (n < 0)
+		return -1;
+	buf[n] = '\0';
+	return n;
+}
+
+/* 0 on success, -1 if the pid is gone */
+static int nas_top_read_stat(const int dir_fd, const char *pid, struct nas_top_proc *p) {
+	char path[32];
+	char buf[512];
+	unsigned long long utime, stime;
+	unsigned int flags;
+
+	snprintf(path, sizeof(path), "%s/stat", pid);
+	if (nas_top_read(dir_fd, path, buf, sizeof(buf)) < 0)
+		return -1;
+
+	/* the comm may contain anything, even ") ", it ends at the last ')' */
+	char *open = strchr(buf, '(');
+	char *close = strrchr(buf, ')');
+	if ((open == NULL) || (close == NULL) || (close < open))
+		return -1;
+
+	size_t len = close - open - 1;
+	if (len >= sizeof(p->comm))
+		len = sizeof(p->comm) - 1;
+	for (size_t i = 0; i < len; i++) {
+		char c = open[1 + i];
+		p->comm[i] = ((c < ' ') || (c > '~') || (c == '"') || (c == '\\')) ? '?' : c;
+	}
+	p->comm[len] = '\0';
+
+	/* state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime
+	 * cutime cstime priority nice num_threads itrealvalue starttime vsize rss */
+	if (sscanf(close + 2, "%*c %*d %*d %*d %*d %*d %u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %llu %*u %lu",
+		   &flags, &utime, &stime, &p->start, &p->rss) != 5)
+		return -1;
+
+	p->ticks = utime + stime;
+	p->kthread = (flags & 0x00200000) != 0;     /* PF_KTHREAD */
+	return 0;
+}
+
+static void nas_top_read_io(const int dir_fd, const char *pid, struct nas_top_proc *p) {
+	char path[32];
+	char buf[512];
+	unsigned long long rd = 0, wr = 0;
+
+	snprintf(path, sizeof(path), "%s/io", pid);
+	if (nas_top_read(dir_fd, path, buf, sizeof(buf)) < 0)
+		return;
+
+	char *s = strstr(buf, "read_bytes:");
+	if (s != NULL)
+		rd = strtoull(s + 11, NULL, 10);
+	if ((s = strstr(buf, "\nwrite_bytes:")) != NULL)
+		wr = strtoull(s + 13, NULL, 10);
+	p->io = rd + wr;
+}
+
+static const struct nas_top_proc *nas_top_find(const pid_t pid) {
+	int lo = 0, hi = nas_top_count - 1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (nas_top_procs[mid].pid == pid)
+			return nas_top_procs + mid;
+		if (nas_top_procs[mid].pid < pid)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return NULL;
+}
+
+static int nas_top_cmp(const void *a, const void *b) {
+	return ((const struct nas_top_proc *)a)->pid - ((const struct nas_top_proc *)b)->pid;
+}
+
+static struct nas_top_proc *nas_top_add(const int count) {
+	if (count >= nas_top_next_size) {
+		int size = nas_top_next_size ? nas_top_next_size * 2 : 256;
+		struct nas_top_proc *p = realloc(nas_top_next, sizeof(*p) * size);
+		if (p == NULL) {
+			syslog(LOG_ERR, "allocate memory for process scan failed: %d", errno);
+			return NULL;
+		}
+		nas_top_next = p;
+		nas_top_next_size = size;
+	}
+	return nas_top_next + count;
+}
+
+static void nas_top_scan(void) {
+	struct timespec ts;
+	struct dirent *de;
+	int dir_fd = dirfd(nas_top_dir);
+	int count = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	double dt = nas_top_scans > 0 ? nas_elapsed_ms(&nas_top_scan_ts) / 1000.0 : 0;
+	nas_top_scan_ts = ts;
+
+	for (int k = 0; k < NAS_TOP_KEYS; k++)
+		nas_top_heaps[k].count = 0;
+
+	rewinddir(nas_top_dir);
+	while ((de = readdir(nas_top_dir)) != NULL) {
+		if ((de->d_name[0] < '1') || (de->d_name[0] > '9'))
+			continue;
+
+		struct nas_top_proc *p = nas_top_add(count);
+		if (p == NULL)
+			break;
+
+		memset(p, 0, sizeof(*p));
+		p->pid = (pid_t)strtol(de->d_name, NULL, 10);
+		if (nas_top_read_stat(dir_fd, de->d_name, p) < 0)
+			continue;
+
+		const struct nas_top_proc *last = nas_top_find(p->pid);
+		if ((last != NULL) && (last->start != p->start))
+			last = NULL;
+
+		if (!p->kthread) {
+			/* idle since the last scan, its io counters can not have moved */
+			if ((last != NULL) && (last->ticks == p->ticks))
+				p->io = last->io;
+			else
+				nas_top_read_io(dir_fd, de->d_name, p);
+		}
+
+		if ((last != NULL) && (dt > 0)) {
+			p->cpu = (float)((double)(p->ticks - last->ticks) * 100 / (double)nas_top_clk_tck / dt);
+			if (p->io >= last->io)
+				p->io_rate = (float)((double)(p->io - last->io) / dt);
+		}
+		count++;
+
+		for (int k = 0; k < NAS_TOP_KEYS; k++)
+			nas_top_heap_push(nas_top_heaps + k, k, p);
+	}
+
+	/* readdir of /proc is in pid order already, qsort only fixes up stragglers */
+	qsort(nas_top_next, (size_t)count, sizeof(*nas_top_next), nas_top_cmp);
+
+	struct nas_top_proc *procs = nas_top_procs;
+	nas_top_procs = nas_top_next;
+	nas_top_next = procs;
+	int size = nas_top_size;
+	nas_top_size = nas_top_next_size;
+	nas_top_next_size = size;
+	nas_top_count = count;
+
+	for (int k = 0; k < NAS_TOP_KEYS; k++)
+		nas_top_heap_sort(nas_top_heaps + k, k);
+
+	nas_top_scans++;
+	nas_top_scan_ms = (double)nas_elapsed_ms(&ts);
+}
+
+void nas_top_update(const time_t now) {
+	if ((nas_top_dir == NULL) || (now - nas_top_ts < top_scan_interval))
+		return;
+
+	nas_top_ts = now;
+	nas_top_scan();
+}
+
+/* the heaviest process by key, NULL if none yet */
+const char *nas_top_first(const int key, double *value) {
+	const struct nas_top_heap *h = nas_top_heaps + key;
+
+	if (h->count == 0)
+		return NULL;
+
+	*value = nas_top_key(h->items, key);
+	if (key == NAS_TOP_RSS)
+		*value *= (double)nas_top_page_size;
+	return h->items[0].comm;
+}
+
+int nas_top_to_json(char *buf, const size_t len) {
+	int count = snprintf(buf, len, "\"scanned\":%d,\"scan_ms\":%.0f", nas_top_count, nas_top_scan_ms);
+
+	for (int k = 0; k < NAS_TOP_KEYS; k++) {
+		const struct nas_top_heap *h = nas_top_heaps + k;
+
+		count += snprintf(buf + count, len - count, ",\"%s\":[", h->name);
+		for (int i = 0; i < h->count; i++) {
+			const struct nas_top_proc *p = h->items + i;
+			count += snprintf(buf + count, len - count,
+					  "%s{\"pid\":%d,\"name\":\"%s\",\"cpu\":%.1f,\"rss\":%lu,\"io\":%.0f}",
+					  i ? "," : "", (int)p->pid, p->comm, p->cpu, p->rss * (unsigned long)nas_top_page_size,
+					  p->io_rate);
+		}
+		buf[count++] = ']';
+	}
+	return count;
+}
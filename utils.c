@@ -7,6 +7,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -131,3 +132,63 @@ int nas_write_file(const char *name, const char *buf, const int count) {
 	}
 	return ret;
 }
+
+long nas_elapsed_ms(const struct timespec *since) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec - since->tv_sec) * 1000 + (ts.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* read a decimal sysfs attribute through a persistent descriptor */
+int nas_pread_long(const int fd, long *value) {
+	char buf[24];
+	ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+
+	const char *p = buf;
+	const char *end = buf + len;
+	long v = 0;
+	int neg = 0;
+
+	while ((p < end) && (*p == ' '))
+		p++;
+	if ((p < end) && (*p == '-')) {
+		neg = 1;
+		p++;
+	}
+	if ((p >= end) || (*p < '0') || (*p > '9'))
+		return -1;
+
+	while ((p < end) && (*p >= '0') && (*p <= '9'))
+		v = v * 10 + (*p++ - '0');
+
+	*value = neg ? -v : v;
+	return 0;
+}
+
+/* read up to count whitespace separated decimals, returns how many parsed */
+int nas_pread_ulongs(const int fd, unsigned long *values, const int count) {
+	char buf[256];
+	ssize_t len = pread(fd, buf, sizeof(buf), 0);
+	if (len <= 0)
+		return -1;
+
+	const char *p = buf;
+	const char *end = buf + len;
+	int n = 0;
+
+	while (n < count) {
+		while ((p < end) && ((*p < '0') || (*p > '9')))
+			p++;
+		if (p >= end)
+			break;
+
+		unsigned long v = 0;
+		while ((p < end) && (*p >= '0') && (*p <= '9'))
+			v = v * 10 + (*p++ - '0');
+		values[n++] = v;
+	}
+
+	return n;
+}